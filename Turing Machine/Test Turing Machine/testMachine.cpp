@@ -10,6 +10,8 @@
 #include "tm.hpp"
 
 #include <sstream>
+#include <cstdio>
+#include <fstream>
 
 SCENARIO("Try simple rewrite single char of the tape") {
     GIVEN("Initialized machine with simple tape and start state") {
@@ -93,5 +95,1161 @@ SCENARIO("Convert multiple to single tape machine") {
                 REQUIRE(sstream.str().compare("#1010#X000#0X00") == 0);
             }
         }
+        
+        WHEN("Compile the machine to single tape machine") {
+            TrackEncoding encoding;
+            TuringMachine single = m.to_single_tape_machine(&encoding);
+            
+            REQUIRE(m.run() == RunResult::ACCEPTED);
+            REQUIRE(single.run() == RunResult::ACCEPTED);
+            
+            THEN("Tracks of the single tape must match the tapes") {
+                vector<string> tracks = encoding.decode(*single.get_tape(0));
+                REQUIRE(tracks == vector<string>({ "1010", "X000", "0X00" }));
+            }
+        }
+        
+        WHEN("Encode tracks over too many symbols") {
+            string symbols;
+            for (int symbol = 1; symbol < 256; ++symbol) {
+                if (symbol != Tape::DELIMITER && symbol != Tape::EMPTY) {
+                    symbols.push_back((char) symbol);
+                }
+            }
+            
+            THEN("Encoding must fail") {
+                REQUIRE_THROWS_AS(TrackEncoding(3, symbols), const std::runtime_error&);
+                REQUIRE_THROWS_AS(TrackEncoding(3, "0#1"), const std::runtime_error&);
+                REQUIRE(TrackEncoding(3, symbols.substr(0, 126)).get_cells().size() == 255);
+                REQUIRE(TrackEncoding(16, "01X").get_cells().size() == 9);
+            }
+        }
+    }
+}
+
+SCENARIO("Compile machine to dense transition table") {
+    GIVEN("Single tape machine with two states") {
+        TuringMachine m;
+        m.start_state("start");
+        m.add_transition(unique_ptr<Transition>(new Transition("start", "0", "X", "R", "start")));
+        m.add_transition(unique_ptr<Transition>(new Transition("start", "1", "1", "L", "back")));
+        m.add_transition(unique_ptr<Transition>(new Transition("back", "X", "0", "L", "back")));
+        m.add_transition(unique_ptr<Transition>(new Transition("back", " ", " ", "R", "halt")));
+        
+        WHEN("Compile the machine") {
+            auto program = m.compile();
+            
+            THEN("Every read symbol must have its own column") {
+                REQUIRE(program);
+                REQUIRE(program->get_alphabet().size() == 4);
+            }
+            
+            AND_THEN("Missing transitions must lead to stuck state") {
+                REQUIRE(program->lookup(1, '1').next == 2);
+                REQUIRE(program->lookup(1, '1').move == -1);
+                REQUIRE(program->lookup(1, 'X').next == TuringMachine::STUCK);
+                REQUIRE(program->lookup(2, '?').next == TuringMachine::STUCK);
+            }
+        }
+        
+        WHEN("Run the machine") {
+            m.add_tape(unique_ptr<Tape>(new Tape("0001")));
+            m.run();
+            
+            THEN("Tape must be rewritten back and machine halted") {
+                std::stringstream sstream;
+                sstream << *m.get_tape(0);
+                
+                REQUIRE(m.is_finished_successfuly());
+                REQUIRE(sstream.str().compare("0001") == 0);
+            }
+        }
+        
+        WHEN("Redirect transition of the compiled machine to halt") {
+            m.add_tape(unique_ptr<Tape>(new Tape("0001")));
+            m.compile();
+            m.retarget("start", 0, "halt");
+            
+            THEN("The machine must halt after the first step") {
+                REQUIRE(m.run() == RunResult::ACCEPTED);
+                REQUIRE(m.get_steps() == 1);
+                REQUIRE(m.get_transitions("start")[0]->get_next_state() == "halt");
+                REQUIRE_THROWS_AS(m.retarget("start", 2, "halt"), const std::out_of_range&);
+            }
+        }
+    }
+}
+
+SCENARIO("Trace executed transitions") {
+    GIVEN("Loop machine with buffered tracing") {
+        TuringMachine m;
+        m.start_state("start");
+        m.add_tape(unique_ptr<Tape>(new Tape("001")));
+        m.add_transition(unique_ptr<Transition>(new Transition("start", "0", "X", "R", "start")));
+        m.add_transition(unique_ptr<Transition>(new Transition("start", "1", "1", "N", "halt")));
+        
+        std::stringstream trace;
+        m.set_trace(TuringMachine::Trace::BUFFERED, trace);
+        
+        WHEN("Run the machine") {
+            m.run();
+            
+            THEN("Every transition must be traced once") {
+                REQUIRE(trace.str().compare("0{start} -> X{start}R\n0{start} -> X{start}R\n1{start} -> 1{halt}N\n") == 0);
+            }
+        }
+        
+        WHEN("Step through the machine") {
+            m.step();
+            
+            THEN("The step must be traced at once") {
+                REQUIRE(trace.str() == "0{start} -> X{start}R\n");
+            }
+        }
+        
+        WHEN("Turn tracing off and run the machine") {
+            m.set_trace(TuringMachine::Trace::OFF);
+            m.run();
+            
+            THEN("Nothing must be traced") {
+                REQUIRE(trace.str().empty());
+                REQUIRE(m.is_finished_successfuly());
+            }
+        }
+    }
+}
+
+SCENARIO("Sweep over long runs of symbols") {
+    GIVEN("Machine scanning right over ones and rewriting zeros back to the left") {
+        TuringMachine m;
+        m.start_state("scan");
+        m.add_transition(unique_ptr<Transition>(new Transition("scan", "1", "1", "R", "scan")));
+        m.add_transition(unique_ptr<Transition>(new Transition("scan", " ", "0", "L", "back")));
+        m.add_transition(unique_ptr<Transition>(new Transition("back", "1", "0", "L", "back")));
+        m.add_transition(unique_ptr<Transition>(new Transition("back", " ", " ", "R", "halt")));
+        
+        string ones(3 * Tape::PAGE_SIZE, '1');
+        
+        WHEN("Run the machine on paged tape") {
+            m.add_tape(unique_ptr<Tape>(new Tape(ones)));
+            m.run();
+            
+            THEN("All ones must be rewritten") {
+                std::stringstream sstream;
+                sstream << *m.get_tape(0);
+                
+                REQUIRE(m.is_finished_successfuly());
+                REQUIRE(sstream.str() == string(ones.size() + 1, '0'));
+                REQUIRE(m.get_tape(0)->read() == '0');
+            }
+        }
+        
+        WHEN("Run the machine on run length encoded tape") {
+            m.add_tape(unique_ptr<Tape>(new Tape(ones, Tape::Storage::RUN_LENGTH)));
+            m.run();
+            
+            THEN("All ones must be rewritten") {
+                std::stringstream sstream;
+                sstream << *m.get_tape(0);
+                
+                REQUIRE(m.is_finished_successfuly());
+                REQUIRE(sstream.str() == string(ones.size() + 1, '0'));
+                REQUIRE(m.get_tape(0)->read() == '0');
+            }
+        }
+    }
+}
+
+SCENARIO("Parse machine from memory buffer") {
+    GIVEN("Transitions with state names containing arrow symbols") {
+        string content = "0{go->right} -> X{go->right}R\n\n1{go->right} -> 1{left-most}L\r\n  X{left-most} -> 0{halt}N\n";
+        
+        WHEN("Parse the machine") {
+            TuringMachine m = TuringMachine::parse_machine(content);
+            
+            THEN("States must be parsed whole") {
+                REQUIRE(m.get_transitions("go->right").size() == 2);
+                REQUIRE(m.get_transitions("left-most").size() == 1);
+                REQUIRE(m.get_transitions("go->right")[1]->get_next_state().compare("left-most") == 0);
+            }
+            
+            AND_THEN("Machine must run") {
+                m.start_state("go->right");
+                m.add_tape(unique_ptr<Tape>(new Tape("001")));
+                m.run();
+                
+                std::stringstream sstream;
+                sstream << *m.get_tape(0);
+                
+                REQUIRE(m.is_finished_successfuly());
+                REQUIRE(sstream.str().compare("X01") == 0);
+            }
+        }
+    }
+    
+    GIVEN("Transitions with blanks between symbols and states") {
+        string content = "0 {start} -> 1\t{halt}R\n";
+        
+        WHEN("Parse the machine") {
+            TuringMachine m = TuringMachine::parse_machine(content);
+            
+            THEN("Blanks must not be part of the symbols") {
+                REQUIRE(m.get_transitions("start").size() == 1);
+                REQUIRE(m.get_transitions("start")[0]->get_read_symbols() == "0");
+                REQUIRE(m.get_transitions("start")[0]->get_write_symbols() == "1");
+            }
+        }
+    }
+    
+    GIVEN("Transitions reading and writing blank symbol") {
+        string content = "_{start} -> X{back}L\n_{back} -> _{halt}R\n";
+        
+        WHEN("Parse and run the machine on empty tape") {
+            TuringMachine m = TuringMachine::parse_machine(content);
+            m.start_state("start");
+            m.add_tape(unique_ptr<Tape>(new Tape("")));
+            
+            THEN("Blank symbol must stand for empty cell") {
+                REQUIRE(m.get_transitions("start")[0]->get_read_symbols() == " ");
+                REQUIRE(m.get_transitions("back")[0]->get_write_symbols() == " ");
+                REQUIRE(m.run() == RunResult::ACCEPTED);
+                
+                std::stringstream sstream;
+                sstream << *m.get_tape(0);
+                REQUIRE(sstream.str() == "X");
+            }
+        }
+    }
+    
+    GIVEN("Transitions with bad commands and counts of symbols") {
+        THEN("Parsing must fail at the first bad field") {
+            const char* contents[] = { "1{s} -> 1{ha}lt}R", "01{s} -> 1{s}RR", "01{s} -> 10{s}R", "0{s} -> 1{s}X" };
+            int columns[] = { 14, 10, 15, 13 };
+            
+            for (int e = 0; e < 4; ++e) {
+                try {
+                    TuringMachine::parse_machine(contents[e]);
+                    FAIL("Parse error expected");
+                } catch (const ParseError& error) {
+                    REQUIRE(error.get_line() == 1);
+                    REQUIRE(error.get_column() == columns[e]);
+                }
+            }
+        }
+    }
+    
+    GIVEN("Transition without arrow on the second line") {
+        string content = "0{start} -> 1{start}R\n0{start} 1{halt}R\n";
+        
+        THEN("Parsing must fail at the missing arrow") {
+            try {
+                TuringMachine::parse_machine(content);
+                FAIL("Parse error expected");
+            } catch (const ParseError& error) {
+                REQUIRE(error.get_line() == 2);
+                REQUIRE(error.get_column() == 10);
+            }
+        }
+    }
+}
+
+SCENARIO("Load machine from file") {
+    GIVEN("File with transitions") {
+        const string filename = "test_machine.tm";
+        std::ofstream(filename) << "0{start} -> X{start}R\n1{start} -> 1{halt}N\n";
+        
+        WHEN("Load the machine and run it") {
+            TuringMachine m = TuringMachine::load_machine(filename);
+            m.start_state("start");
+            m.add_tape(unique_ptr<Tape>(new Tape("001")));
+            
+            THEN("Machine must run the transitions of the file") {
+                REQUIRE(m.get_transitions("start").size() == 2);
+                REQUIRE(m.run() == RunResult::ACCEPTED);
+                
+                std::stringstream sstream;
+                sstream << *m.get_tape(0);
+                REQUIRE(sstream.str() == "XX1");
+            }
+        }
+        
+        WHEN("Load file with error on the second line") {
+            std::ofstream(filename) << "0{start} -> X{start}R\n1{start} 1{halt}N\n";
+            
+            THEN("Loading must fail at the line") {
+                try {
+                    TuringMachine::load_machine(filename);
+                    FAIL("Parse error expected");
+                } catch (const ParseError& error) {
+                    REQUIRE(error.get_line() == 2);
+                }
+            }
+        }
+        
+        WHEN("Load empty file") {
+            std::ofstream(filename, std::ios::trunc).close();
+            TuringMachine m = TuringMachine::load_machine(filename);
+            
+            THEN("Machine must have no transitions") {
+                REQUIRE(m.get_states().empty());
+            }
+        }
+        
+        std::remove(filename.c_str());
+        
+        WHEN("Load file which does not exist") {
+            TuringMachine m = TuringMachine::load_machine(filename);
+            
+            THEN("Machine must have no transitions") {
+                REQUIRE(m.get_states().empty());
+            }
+        }
+    }
+}
+
+SCENARIO("Save and load compiled machine") {
+    GIVEN("Compiled machine saved to file") {
+        TuringMachine m;
+        m.start_state("start");
+        m.add_transition(unique_ptr<Transition>(new Transition("start", "0", "X", "R", "start")));
+        m.add_transition(unique_ptr<Transition>(new Transition("start", "1", "1", "L", "back")));
+        m.add_transition(unique_ptr<Transition>(new Transition("back", "X", "0", "L", "back")));
+        
+        const string filename = "test_machine.tmc";
+        REQUIRE(m.save_compiled(filename));
+        
+        WHEN("Load the machine and run it") {
+            TuringMachine loaded = TuringMachine::load_compiled(filename);
+            loaded.add_tape(unique_ptr<Tape>(new Tape("001")));
+            loaded.run();
+            
+            THEN("Machine must behave as the original") {
+                std::stringstream sstream;
+                sstream << *loaded.get_tape(0);
+                
+                REQUIRE(sstream.str().compare("001") == 0);
+                REQUIRE_FALSE(loaded.is_finished_successfuly());
+            }
+        }
+        
+        WHEN("Load the machine and change it") {
+            TuringMachine loaded = TuringMachine::load_compiled(filename);
+            loaded.add_transition(unique_ptr<Transition>(new Transition("back", " ", " ", "R", "halt")));
+            loaded.add_tape(unique_ptr<Tape>(new Tape("001")));
+            loaded.run();
+            
+            THEN("Loaded transitions must be kept") {
+                REQUIRE(loaded.get_transitions("start").size() == 2);
+                REQUIRE(loaded.is_finished_successfuly());
+            }
+        }
+        
+        WHEN("Save and load machine without transitions") {
+            TuringMachine empty;
+            empty.start_state("start");
+            const string empty_filename = "test_empty_machine.tmc";
+            REQUIRE(empty.save_compiled(empty_filename));
+            TuringMachine loaded = TuringMachine::load_compiled(empty_filename);
+            std::remove(empty_filename.c_str());
+            loaded.add_tape(unique_ptr<Tape>(new Tape("1")));
+            
+            THEN("Loaded machine must be stuck at once") {
+                REQUIRE(loaded.run() == RunResult::STUCK);
+                REQUIRE(loaded.get_steps() == 0);
+            }
+        }
+        
+        WHEN("Load file which is not compiled machine") {
+            std::ofstream(filename) << "0{start} -> 1{halt}R";
+            
+            THEN("Loading must fail") {
+                REQUIRE_THROWS_AS(TuringMachine::load_compiled(filename), const std::runtime_error&);
+            }
+        }
+        
+        std::remove(filename.c_str());
+    }
+}
+
+SCENARIO("Detect machines which never stop") {
+    GIVEN("Machine toggling symbol back and forth while moving") {
+        TuringMachine m;
+        m.start_state("set");
+        m.add_transition(unique_ptr<Transition>(new Transition("set", "0", "1", "R", "right")));
+        m.add_transition(unique_ptr<Transition>(new Transition("right", "0", "0", "L", "reset")));
+        m.add_transition(unique_ptr<Transition>(new Transition("reset", "1", "0", "N", "set")));
+        m.set_cycle_detection(true);
+        
+        WHEN("Run the machine on paged tape") {
+            m.add_tape(unique_ptr<Tape>(new Tape("00")));
+            
+            THEN("Machine must be reported as looping") {
+                REQUIRE(m.run() == RunResult::LOOPING);
+                REQUIRE_FALSE(m.is_finished_successfuly());
+            }
+        }
+        
+        WHEN("Run the machine on run length encoded tape") {
+            m.add_tape(unique_ptr<Tape>(new Tape("00", Tape::Storage::RUN_LENGTH)));
+            
+            THEN("Machine must be reported as looping") {
+                REQUIRE(m.run() == RunResult::LOOPING);
+            }
+        }
+    }
+    
+    GIVEN("Machine which halts after rewriting its tape") {
+        TuringMachine m;
+        m.start_state("start");
+        m.add_tape(unique_ptr<Tape>(new Tape("0001")));
+        m.add_transition(unique_ptr<Transition>(new Transition("start", "0", "1", "R", "start")));
+        m.add_transition(unique_ptr<Transition>(new Transition("start", "1", "1", "N", "halt")));
+        m.set_cycle_detection(true);
+        
+        THEN("Machine must halt") {
+            REQUIRE(m.run() == RunResult::ACCEPTED);
+            REQUIRE(m.is_finished_successfuly());
+        }
+    }
+}
+
+SCENARIO("Limit steps and time of running machine") {
+    GIVEN("Machine which moves right forever") {
+        TuringMachine m;
+        m.start_state("start");
+        m.add_tape(unique_ptr<Tape>(new Tape("0")));
+        m.add_transition(unique_ptr<Transition>(new Transition("start", "0", "0", "R", "start")));
+        m.add_transition(unique_ptr<Transition>(new Transition("start", " ", "0", "R", "start")));
+        
+        WHEN("Run the machine with step budget") {
+            RunResult result = m.run(1000);
+            
+            THEN("Machine must stop after the budget is spent") {
+                REQUIRE(result == RunResult::STEP_LIMIT);
+                REQUIRE(m.get_steps() == 1000);
+                REQUIRE_FALSE(m.is_finished_successfuly());
+            }
+        }
+        
+        WHEN("Run the machine with deadline which already passed") {
+            RunResult result = m.run(UINT64_MAX, std::chrono::steady_clock::now());
+            
+            THEN("Machine must stop on timeout") {
+                REQUIRE(result == RunResult::TIMEOUT);
+            }
+        }
+    }
+    
+    GIVEN("Machine which halts") {
+        TuringMachine m;
+        m.start_state("start");
+        m.add_tape(unique_ptr<Tape>(new Tape("000")));
+        m.add_transition(unique_ptr<Transition>(new Transition("start", "0", "1", "R", "start")));
+        m.add_transition(unique_ptr<Transition>(new Transition("start", " ", " ", "N", "halt")));
+        
+        THEN("Machine must halt within the budget and count its steps") {
+            REQUIRE(m.run(1000) == RunResult::ACCEPTED);
+            REQUIRE(m.get_steps() == 4);
+        }
+    }
+}
+
+SCENARIO("Run machine on batch of inputs") {
+    GIVEN("Machine which inverts binary input") {
+        TuringMachine m;
+        m.start_state("start");
+        m.add_transition(unique_ptr<Transition>(new Transition("start", "0", "1", "R", "start")));
+        m.add_transition(unique_ptr<Transition>(new Transition("start", "1", "0", "R", "start")));
+        m.add_transition(unique_ptr<Transition>(new Transition("start", " ", " ", "N", "halt")));
+        
+        WHEN("Run the machine on many inputs") {
+            std::vector<std::string> inputs;
+            for (int i = 0; i < 100; ++i) {
+                inputs.push_back(std::string(i % 7, '0') + std::string(i % 5, '1'));
+            }
+            inputs.push_back("2");
+            
+            std::vector<BatchResult> results = m.run_batch(inputs, 4);
+            
+            THEN("Results must be returned in order of the inputs") {
+                REQUIRE(results.size() == inputs.size());
+                for (int i = 0; i < 100; ++i) {
+                    REQUIRE(results[i].result == RunResult::ACCEPTED);
+                    REQUIRE(results[i].output == std::string(i % 7, '1') + std::string(i % 5, '0'));
+                    REQUIRE(results[i].steps == i % 7 + i % 5 + 1);
+                }
+                REQUIRE(results[100].result == RunResult::STUCK);
+            }
+        }
+    }
+}
+
+SCENARIO("Run many executions of one program") {
+    GIVEN("Compiled program of machine which inverts binary input") {
+        TuringMachine m;
+        m.start_state("start");
+        m.add_transition(unique_ptr<Transition>(new Transition("start", "0", "1", "R", "start")));
+        m.add_transition(unique_ptr<Transition>(new Transition("start", "1", "0", "R", "start")));
+        m.add_transition(unique_ptr<Transition>(new Transition("start", " ", " ", "N", "halt")));
+        std::shared_ptr<const Program> program = m.compile();
+        
+        WHEN("Run two executions of the program") {
+            Execution first(program, "0011");
+            Execution second(program, "10");
+            
+            REQUIRE(first.step());
+            REQUIRE(first.get_steps() == 1);
+            REQUIRE(second.run() == RunResult::ACCEPTED);
+            REQUIRE(first.run() == RunResult::ACCEPTED);
+            
+            THEN("Executions must not share their tapes") {
+                std::stringstream output;
+                output << first.get_tape() << "|" << second.get_tape();
+                
+                REQUIRE(output.str() == "1100|01");
+                REQUIRE(first.get_steps() == 5);
+                REQUIRE(second.get_steps() == 3);
+                REQUIRE(first.is_finished_successfuly());
+                REQUIRE_FALSE(first.step());
+            }
+        }
+    }
+}
+
+SCENARIO("Run nondeterministic machine") {
+    GIVEN("Machine which guesses where two ones follow each other") {
+        TuringMachine m;
+        m.start_state("start");
+        m.add_transition(unique_ptr<Transition>(new Transition("start", "0", "0", "R", "start")));
+        m.add_transition(unique_ptr<Transition>(new Transition("start", "1", "1", "R", "start")));
+        m.add_transition(unique_ptr<Transition>(new Transition("start", "1", "1", "R", "second")));
+        m.add_transition(unique_ptr<Transition>(new Transition("second", "1", "X", "N", "halt")));
+        std::shared_ptr<const Program> program = m.compile();
+        
+        WHEN("Search input with two ones next to each other") {
+            SearchResult single = NondeterministicRunner(program, 1).run("0110");
+            SearchResult parallel = NondeterministicRunner(program, 4).run("0110");
+            
+            THEN("Accepting path must be found") {
+                REQUIRE(single.result == RunResult::ACCEPTED);
+                REQUIRE(single.output == "01X0");
+                REQUIRE(single.path == std::vector<int>({ 0, 1, 0 }));
+                REQUIRE(program->get_state_name(single.states[1]) == "second");
+                REQUIRE(single.states.back() == TuringMachine::HALT);
+                REQUIRE(parallel.path == single.path);
+            }
+        }
+        
+        WHEN("Search from the machine without tape") {
+            SearchResult result = m.run_nondeterministic();
+            
+            THEN("Empty tape must be searched") {
+                REQUIRE(result.result == RunResult::STUCK);
+                REQUIRE(result.path.empty());
+            }
+        }
+        
+        WHEN("Search input without two ones next to each other") {
+            SearchResult result = NondeterministicRunner(program).run("0101");
+            
+            THEN("No path must be accepted") {
+                REQUIRE(result.result == RunResult::STUCK);
+                REQUIRE(result.path.empty());
+            }
+        }
+        
+        WHEN("Search with depth smaller than the accepting path") {
+            Program::Options options;
+            options.max_steps = 2;
+            
+            THEN("Search must stop on the limit") {
+                REQUIRE(NondeterministicRunner(program).run("0110", options).result == RunResult::STEP_LIMIT);
+            }
+        }
+        
+        WHEN("Run the machine deterministically") {
+            m.add_tape(unique_ptr<Tape>(new Tape("0110")));
+            
+            THEN("Only the first transition must be followed") {
+                REQUIRE(m.run_nondeterministic().result == RunResult::ACCEPTED);
+                REQUIRE(m.run() == RunResult::STUCK);
+            }
+        }
+    }
+}
+
+SCENARIO("Prune repeated configurations of nondeterministic machine") {
+    GIVEN("Machine which walks randomly until it finds a mark") {
+        TuringMachine m;
+        m.start_state("walk");
+        m.add_transition(unique_ptr<Transition>(new Transition("walk", " ", " ", "L", "walk")));
+        m.add_transition(unique_ptr<Transition>(new Transition("walk", " ", " ", "R", "walk")));
+        m.add_transition(unique_ptr<Transition>(new Transition("walk", "1", "1", "S", "halt")));
+        NondeterministicRunner runner(m.compile());
+        
+        Program::Options options;
+        options.max_configurations = 100000;
+        std::string input = std::string(40, ' ') + "1";
+        
+        WHEN("Search with pruning of repeated configurations") {
+            SearchResult result = runner.run(input, options);
+            
+            THEN("The shortest path to the mark must be found") {
+                REQUIRE(result.result == RunResult::ACCEPTED);
+                REQUIRE(result.path.size() == 41);
+                REQUIRE(result.configurations < 5000);
+            }
+        }
+        
+        WHEN("Search without pruning") {
+            runner.set_deduplication(false);
+            
+            THEN("Count of configurations must explode") {
+                REQUIRE(runner.run(input, options).result == RunResult::STEP_LIMIT);
+            }
+        }
+    }
+}
+
+SCENARIO("Convert nondeterministic machine to deterministic") {
+    GIVEN("Machine which guesses where two ones follow each other") {
+        TuringMachine m;
+        m.start_state("start");
+        m.add_transition(unique_ptr<Transition>(new Transition("start", "0", "0", "R", "start")));
+        m.add_transition(unique_ptr<Transition>(new Transition("start", "1", "1", "R", "start")));
+        m.add_transition(unique_ptr<Transition>(new Transition("start", "1", "1", "R", "second")));
+        m.add_transition(unique_ptr<Transition>(new Transition("second", "1", "X", "N", "halt")));
+        
+        WHEN("Run deterministic machine on input with two ones next to each other") {
+            m.add_tape(unique_ptr<Tape>(new Tape("10110")));
+            TuringMachine deterministic = m.to_deterministic();
+            
+            THEN("The input must be rewritten as by the accepting path") {
+                REQUIRE(deterministic.run(100000) == RunResult::ACCEPTED);
+                
+                std::stringstream output;
+                output << *deterministic.get_tape(0);
+                REQUIRE(output.str() == "101X0");
+            }
+        }
+        
+        WHEN("Run deterministic machine on input without two ones next to each other") {
+            m.add_tape(unique_ptr<Tape>(new Tape("1010")));
+            TuringMachine deterministic = m.to_deterministic();
+            
+            THEN("The machine must not halt") {
+                REQUIRE(deterministic.run(100000) == RunResult::STEP_LIMIT);
+            }
+        }
+        
+        WHEN("Convert the machine with input on its tape") {
+            m.add_tape(unique_ptr<Tape>(new Tape("10110")));
+            TuringMachine deterministic = m.to_deterministic();
+            
+            THEN("The input must be on the first of four tapes") {
+                std::stringstream output;
+                output << *deterministic.get_tape(0);
+                REQUIRE(output.str() == "10110");
+                REQUIRE(deterministic.get_tape(3) != nullptr);
+            }
+        }
+        
+        WHEN("Convert the machine with transition of two tapes") {
+            m.add_transition(unique_ptr<Transition>(new Transition("second", "0 ", "0 ", "SS", "halt")));
+            
+            THEN("Conversion must fail") {
+                REQUIRE_THROWS_AS(m.to_deterministic(), const std::runtime_error&);
+            }
+        }
+    }
+}
+
+SCENARIO("Compare nondeterministic search with deterministic machine", "[.][benchmark]") {
+    GIVEN("Machine which guesses where two ones follow each other") {
+        TuringMachine m;
+        m.start_state("start");
+        m.add_transition(unique_ptr<Transition>(new Transition("start", "0", "0", "R", "start")));
+        m.add_transition(unique_ptr<Transition>(new Transition("start", "1", "1", "R", "start")));
+        m.add_transition(unique_ptr<Transition>(new Transition("start", "1", "1", "R", "second")));
+        m.add_transition(unique_ptr<Transition>(new Transition("second", "1", "X", "N", "halt")));
+        
+        std::string input;
+        for (int i = 0; i < 6; ++i) {
+            input += "10";
+        }
+        input += "110";
+        m.add_tape(unique_ptr<Tape>(new Tape(input)));
+        
+        WHEN("Run both to the accepting path") {
+            auto begin = std::chrono::steady_clock::now();
+            SearchResult search = m.run_nondeterministic();
+            auto searched = std::chrono::steady_clock::now();
+            
+            TuringMachine deterministic = m.to_deterministic();
+            auto converted = std::chrono::steady_clock::now();
+            RunResult result = deterministic.run();
+            auto finished = std::chrono::steady_clock::now();
+            
+            THEN("Both must accept and report their costs") {
+                REQUIRE(search.result == RunResult::ACCEPTED);
+                REQUIRE(result == RunResult::ACCEPTED);
+                
+                typedef std::chrono::microseconds us;
+                WARN("nondeterministic search: " << search.configurations << " configurations, "
+                     << std::chrono::duration_cast<us>(searched - begin).count() << " us");
+                WARN("deterministic machine: " << deterministic.get_steps() << " steps, "
+                     << std::chrono::duration_cast<us>(converted - searched).count() << " us to convert, "
+                     << std::chrono::duration_cast<us>(finished - converted).count() << " us to run");
+            }
+        }
+    }
+}
+
+SCENARIO("Compile multiple tape machine") {
+    GIVEN("Machine which copies first tape to the second in reverse order") {
+        TuringMachine m;
+        m.start_state("end");
+        m.add_tape(unique_ptr<Tape>(new Tape("0011")));
+        m.add_tape(unique_ptr<Tape>(new Tape("")));
+        m.add_transition(unique_ptr<Transition>(new Transition("end", "0 ", "0 ", "RS", "end")));
+        m.add_transition(unique_ptr<Transition>(new Transition("end", "1 ", "1 ", "RS", "end")));
+        m.add_transition(unique_ptr<Transition>(new Transition("end", "  ", "  ", "LS", "copy")));
+        m.add_transition(unique_ptr<Transition>(new Transition("copy", "0 ", "00", "LR", "copy")));
+        m.add_transition(unique_ptr<Transition>(new Transition("copy", "1 ", "11", "LR", "copy")));
+        m.add_transition(unique_ptr<Transition>(new Transition("copy", "  ", "  ", "SS", "halt")));
+        
+        WHEN("Compile the machine") {
+            std::shared_ptr<const MultiTapeProgram> program = m.compile_multi_tape();
+            
+            THEN("Transitions must be found by state and symbols of all tapes") {
+                REQUIRE(program);
+                REQUIRE(program->get_tapes_count() == 2);
+                REQUIRE(program->lookup(1, '0' | ' ' << 8) != nullptr);
+                REQUIRE(program->lookup(1, '0' | '0' << 8) == nullptr);
+            }
+        }
+        
+        WHEN("Run the machine") {
+            THEN("The second tape must hold the reversed input") {
+                REQUIRE(m.run() == RunResult::ACCEPTED);
+                REQUIRE(m.get_steps() == 10);
+                
+                std::stringstream output;
+                output << *m.get_tape(1);
+                REQUIRE(output.str() == "1100");
+            }
+        }
+        
+        WHEN("Add tape after the machine was compiled") {
+            REQUIRE(m.run(0) == RunResult::STEP_LIMIT);
+            m.add_tape(unique_ptr<Tape>(new Tape("")));
+            
+            THEN("The program for two tapes must not be used") {
+                REQUIRE(m.run() == RunResult::STUCK);
+                REQUIRE(m.compile_multi_tape() == nullptr);
+            }
+        }
+    }
+}
+
+SCENARIO("Match symbols of all tapes") {
+    GIVEN("Machine which marks where two tapes differ") {
+        TuringMachine m;
+        m.start_state("compare");
+        m.add_tape(unique_ptr<Tape>(new Tape("0101")));
+        m.add_tape(unique_ptr<Tape>(new Tape("0011")));
+        m.add_transition(unique_ptr<Transition>(new Transition("compare", "00", "00", "RR", "compare")));
+        m.add_transition(unique_ptr<Transition>(new Transition("compare", "01", "X1", "RR", "compare")));
+        m.add_transition(unique_ptr<Transition>(new Transition("compare", "10", "X0", "RR", "compare")));
+        m.add_transition(unique_ptr<Transition>(new Transition("compare", "11", "11", "RR", "compare")));
+        m.add_transition(unique_ptr<Transition>(new Transition("compare", "  ", "  ", "SS", "halt")));
+        
+        WHEN("Step through the machine") {
+            std::stringstream trace;
+            m.set_trace(TuringMachine::Trace::BUFFERED, trace);
+            m.run();
+            
+            THEN("Transitions must be chosen by symbols of both tapes") {
+                std::stringstream output;
+                output << *m.get_tape(0);
+                REQUIRE(m.is_finished_successfuly());
+                REQUIRE(output.str() == "0XX1");
+            }
+        }
+        
+        WHEN("Run the machine converted to single tape") {
+            m.to_single_tape();
+            m.run();
+            
+            THEN("Transitions must be chosen by symbols of all tracks") {
+                std::stringstream output;
+                output << *m.get_tape(0);
+                REQUIRE(m.is_finished_successfuly());
+                REQUIRE(output.str() == "#0XX1#0011");
+            }
+        }
+    }
+}
+
+SCENARIO("Convert running machine to single tape") {
+    GIVEN("Machine which copies first tape to empty second tape") {
+        TuringMachine m;
+        m.start_state("copy");
+        m.add_tape(unique_ptr<Tape>(new Tape("0110")));
+        m.add_tape(unique_ptr<Tape>(new Tape("")));
+        m.add_transition(unique_ptr<Transition>(new Transition("copy", "0 ", "00", "RR", "copy")));
+        m.add_transition(unique_ptr<Transition>(new Transition("copy", "1 ", "11", "RR", "copy")));
+        m.add_transition(unique_ptr<Transition>(new Transition("copy", "  ", "  ", "SS", "halt")));
+        
+        WHEN("Convert the machine in the middle of the run") {
+            REQUIRE(m.run(2) == RunResult::STEP_LIMIT);
+            m.to_single_tape();
+            
+            THEN("Heads must stay where they were and the run must go on") {
+                REQUIRE(m.get_tape(0)->get_tracks_count() == 2);
+                REQUIRE(m.get_tape(0)->read() == '1');
+                REQUIRE(m.get_tape(0)->read(0) == ' ');
+                REQUIRE(m.run() == RunResult::ACCEPTED);
+                
+                std::stringstream output;
+                output << *m.get_tape(0);
+                REQUIRE(output.str() == "#0110#0110");
+            }
+        }
+    }
+}
+
+//
+// Machine which reverses first tape to empty second tape
+//
+static void add_reverse_transitions(TuringMachine& m) {
+    m.start_state("seek");
+    m.add_transition(unique_ptr<Transition>(new Transition("seek", "0 ", "0 ", "RS", "seek")));
+    m.add_transition(unique_ptr<Transition>(new Transition("seek", "1 ", "1 ", "RS", "seek")));
+    m.add_transition(unique_ptr<Transition>(new Transition("seek", "  ", "  ", "LS", "reverse")));
+    m.add_transition(unique_ptr<Transition>(new Transition("reverse", "0 ", "00", "LR", "reverse")));
+    m.add_transition(unique_ptr<Transition>(new Transition("reverse", "1 ", "11", "LR", "reverse")));
+    m.add_transition(unique_ptr<Transition>(new Transition("reverse", "  ", "  ", "SS", "halt")));
+}
+
+SCENARIO("Compile multiple tape machine to single tape machine") {
+    GIVEN("Machine which reverses first tape to empty second tape") {
+        TuringMachine m;
+        add_reverse_transitions(m);
+        m.add_tape(unique_ptr<Tape>(new Tape("0111")));
+        m.add_tape(unique_ptr<Tape>(new Tape("")));
+        
+        TrackEncoding encoding;
+        TuringMachine single = m.to_single_tape_machine(&encoding);
+        
+        WHEN("Run both machines") {
+            REQUIRE(m.run() == RunResult::ACCEPTED);
+            REQUIRE(single.run() == RunResult::ACCEPTED);
+            
+            THEN("Decoded tracks of the single tape must match the tapes") {
+                vector<string> tracks = encoding.decode(*single.get_tape(0));
+                REQUIRE(tracks.size() == 2);
+                REQUIRE(tracks[0] == "0111");
+                REQUIRE(tracks[1] == "1110");
+                REQUIRE(single.get_steps() > m.get_steps());
+            }
+        }
+        
+        WHEN("Mark symbols of the tracks") {
+            char marked = encoding.mark('1');
+            
+            THEN("Marked symbol must be unmarked to the same symbol") {
+                REQUIRE(encoding.is_marked(marked));
+                REQUIRE_FALSE(encoding.is_marked('1'));
+                REQUIRE_FALSE(encoding.is_marked(Tape::DELIMITER));
+                REQUIRE(encoding.unmark(marked) == '1');
+                REQUIRE(encoding.unmark(encoding.mark(Tape::EMPTY)) == Tape::EMPTY);
+            }
+        }
+    }
+}
+
+SCENARIO("Measure steps of single tape simulation", "[.][benchmark]") {
+    GIVEN("Machine which reverses first tape to empty second tape") {
+        for (int length = 8; length <= 256; length *= 2) {
+            TuringMachine m;
+            add_reverse_transitions(m);
+            m.add_tape(unique_ptr<Tape>(new Tape(std::string(length, '1'))));
+            m.add_tape(unique_ptr<Tape>(new Tape("")));
+            TuringMachine single = m.to_single_tape_machine();
+            
+            REQUIRE(m.run() == RunResult::ACCEPTED);
+            REQUIRE(single.run() == RunResult::ACCEPTED);
+            
+            WARN("input of " << length << " symbols: " << m.get_steps() << " steps on two tapes, "
+                 << single.get_steps() << " steps on single tape, "
+                 << (double) single.get_steps() / m.get_steps() << " times more");
+        }
+    }
+}
+
+SCENARIO("Compose machines without copying transitions") {
+    GIVEN("Machine rewriting zeros with X and machine rewriting one with Y") {
+        TuringMachine first;
+        first.start_state("zeros");
+        first.add_transition(unique_ptr<Transition>(new Transition("zeros", "0", "X", "R", "zeros")));
+        first.add_transition(unique_ptr<Transition>(new Transition("zeros", "1", "1", "S", "halt")));
+        first.add_tape(unique_ptr<Tape>(new Tape("0001")));
+        
+        TuringMachine second;
+        second.start_state("one");
+        second.add_transition(unique_ptr<Transition>(new Transition("one", "1", "Y", "R", "halt")));
+        
+        WHEN("Compose with machine passed by reference") {
+            first.compose(second);
+            
+            THEN("Both machines must run one after another and the second must stay") {
+                REQUIRE(first.run() == RunResult::ACCEPTED);
+                std::stringstream output;
+                output << *first.get_tape(0);
+                REQUIRE(output.str() == "XXXY");
+                REQUIRE(second.get_transitions("one").size() == 1);
+            }
+        }
+        
+        WHEN("Compose the machine with itself") {
+            first.compose(first);
+            
+            THEN("The machine must run twice one after another") {
+                REQUIRE(first.get_transitions("zeros").size() == 2);
+                REQUIRE(first.get_transitions("zeros/2").size() == 2);
+                REQUIRE(first.run() == RunResult::ACCEPTED);
+                std::stringstream output;
+                output << *first.get_tape(0);
+                REQUIRE(output.str() == "XXX1");
+            }
+        }
+        
+        WHEN("Compose the machine onto machine starting in accept state") {
+            TuringMachine identity;
+            identity.add_tape(unique_ptr<Tape>(new Tape("0001")));
+            identity.compose(first);
+            
+            THEN("The composed machine must run from its start") {
+                REQUIRE(identity.run() == RunResult::ACCEPTED);
+                std::stringstream output;
+                output << *identity.get_tape(0);
+                REQUIRE(output.str() == "XXX1");
+            }
+        }
+        
+        WHEN("Compose with moved machine") {
+            first.compose(std::move(second));
+            
+            THEN("Both machines must run one after another") {
+                REQUIRE(first.get_transitions("one").size() == 1);
+                REQUIRE(first.run() == RunResult::ACCEPTED);
+                std::stringstream output;
+                output << *first.get_tape(0);
+                REQUIRE(output.str() == "XXXY");
+            }
+        }
+    }
+}
+
+SCENARIO("Compose machines using the same state names") {
+    GIVEN("Two machines both starting in state start") {
+        TuringMachine first;
+        first.start_state("start");
+        first.add_transition(unique_ptr<Transition>(new Transition("start", "0", "X", "R", "start")));
+        first.add_transition(unique_ptr<Transition>(new Transition("start", "1", "1", "L", "halt")));
+        first.add_tape(unique_ptr<Tape>(new Tape("001")));
+        
+        TuringMachine second;
+        second.start_state("start");
+        second.add_transition(unique_ptr<Transition>(new Transition("start", "X", "Y", "L", "start")));
+        
+        WHEN("Compose the machines") {
+            first.compose(second);
+            
+            THEN("States of the second machine must get own names") {
+                REQUIRE(first.get_transitions("start").size() == 2);
+                REQUIRE(first.get_transitions("start/2").size() == 1);
+                REQUIRE(first.get_transitions("start")[1]->get_next_state() == "start/2");
+                REQUIRE(first.get_transitions("start/2")[0]->get_next_state() == "start/2");
+                
+                REQUIRE(first.run() == RunResult::STUCK);
+                std::stringstream output;
+                output << *first.get_tape(0);
+                REQUIRE(output.str() == "YY1");
+            }
+        }
+    }
+}
+
+SCENARIO("Branch to one of two machines by result of the third") {
+    GIVEN("Condition accepting one, and machines writing T and E") {
+        TuringMachine condition;
+        condition.start_state("start");
+        condition.add_transition(unique_ptr<Transition>(new Transition("start", "1", "1", "R", "halt")));
+        condition.add_transition(unique_ptr<Transition>(new Transition("start", "0", "0", "R", "reject")));
+        condition.set_reject_states({ "reject" });
+        
+        TuringMachine then_machine;
+        then_machine.start_state("start");
+        then_machine.add_transition(unique_ptr<Transition>(new Transition("start", " ", "T", "S", "halt")));
+        
+        TuringMachine else_machine;
+        else_machine.start_state("start");
+        else_machine.add_transition(unique_ptr<Transition>(new Transition("start", " ", "E", "S", "halt")));
+        
+        TuringMachine branch = TuringMachine::branch(condition, then_machine, else_machine);
+        
+        WHEN("Run the branch on accepted input") {
+            TuringMachine m(branch);
+            m.add_tape(unique_ptr<Tape>(new Tape("1")));
+            
+            THEN("The then machine must run") {
+                REQUIRE(m.run() == RunResult::ACCEPTED);
+                std::stringstream output;
+                output << *m.get_tape(0);
+                REQUIRE(output.str() == "1T");
+            }
+        }
+        
+        WHEN("Branch by condition which accepts right away") {
+            TuringMachine m = TuringMachine::branch(TuringMachine(), then_machine, else_machine);
+            m.add_tape(unique_ptr<Tape>(new Tape("")));
+            
+            THEN("The then machine must run") {
+                REQUIRE(m.run() == RunResult::ACCEPTED);
+                std::stringstream output;
+                output << *m.get_tape(0);
+                REQUIRE(output.str() == "T");
+            }
+        }
+        
+        WHEN("Branch by condition which rejects right away") {
+            TuringMachine rejecting;
+            rejecting.start_state("reject");
+            rejecting.set_reject_states({ "reject" });
+            TuringMachine m = TuringMachine::branch(rejecting, then_machine, else_machine);
+            m.add_tape(unique_ptr<Tape>(new Tape("")));
+            
+            THEN("The else machine must run") {
+                REQUIRE(m.run() == RunResult::ACCEPTED);
+                std::stringstream output;
+                output << *m.get_tape(0);
+                REQUIRE(output.str() == "E");
+            }
+        }
+        
+        WHEN("Run the branch on rejected input") {
+            TuringMachine m(branch);
+            m.add_tape(unique_ptr<Tape>(new Tape("0")));
+            
+            THEN("The else machine must run") {
+                REQUIRE(m.run() == RunResult::ACCEPTED);
+                std::stringstream output;
+                output << *m.get_tape(0);
+                REQUIRE(output.str() == "0E");
+            }
+        }
+    }
+}
+
+SCENARIO("Accept and reject by configured halting states") {
+    GIVEN("Machine accepting input starting with one in state yes and rejecting in state no") {
+        TuringMachine m;
+        m.start_state("start");
+        m.add_transition(unique_ptr<Transition>(new Transition("start", "1", "1", "R", "yes")));
+        m.add_transition(unique_ptr<Transition>(new Transition("start", "0", "0", "R", "no")));
+        m.add_transition(unique_ptr<Transition>(new Transition("no", "1", "1", "R", "start")));
+        m.set_accept_states({ "yes" });
+        m.set_reject_states({ "no" });
+        
+        WHEN("Run the machine on inputs") {
+            THEN("Every input must be classified without running past the halting states") {
+                std::vector<std::string> inputs = { "1", "01", "", "10" };
+                std::vector<RunResult> expected = { RunResult::ACCEPTED, RunResult::REJECTED, RunResult::STUCK, RunResult::ACCEPTED };
+                
+                for (size_t i = 0; i < inputs.size(); ++i) {
+                    TuringMachine copy(m);
+                    copy.add_tape(unique_ptr<Tape>(new Tape(inputs[i])));
+                    REQUIRE(copy.run() == expected[i]);
+                    REQUIRE(copy.get_steps() == (inputs[i].empty() ? 0 : 1));
+                    REQUIRE(copy.is_finished_successfuly() == (expected[i] == RunResult::ACCEPTED));
+                }
+                
+                std::vector<BatchResult> results = m.run_batch(inputs, 2);
+                for (size_t i = 0; i < inputs.size(); ++i) {
+                    REQUIRE(results[i].result == expected[i]);
+                }
+            }
+        }
+        
+        WHEN("Compose with machine accepting in halt state") {
+            TuringMachine second;
+            second.start_state("start");
+            second.add_transition(unique_ptr<Transition>(new Transition("start", " ", "Z", "S", "halt")));
+            m.compose(second);
+            m.add_tape(unique_ptr<Tape>(new Tape("1")));
+            
+            THEN("The composed machine must accept in halt state of the second machine") {
+                REQUIRE(m.run() == RunResult::ACCEPTED);
+                std::stringstream output;
+                output << *m.get_tape(0);
+                REQUIRE(output.str() == "1Z");
+            }
+        }
+        
+        WHEN("Use halt as ordinary state") {
+            m.add_transition(unique_ptr<Transition>(new Transition("start", "X", "X", "R", "halt")));
+            m.add_transition(unique_ptr<Transition>(new Transition("halt", "1", "1", "R", "yes")));
+            m.add_tape(unique_ptr<Tape>(new Tape("X1")));
+            
+            THEN("The compiled machine must follow transitions of halt") {
+                REQUIRE(m.run() == RunResult::ACCEPTED);
+                REQUIRE(m.get_steps() == 2);
+            }
+        }
+        
+        WHEN("Step through the machine by the interpreter") {
+            std::stringstream trace;
+            m.add_tape(unique_ptr<Tape>(new Tape("0")));
+            m.set_trace(TuringMachine::Trace::BUFFERED, trace);
+            
+            THEN("The machine must stop in reject state") {
+                REQUIRE(m.run_nondeterministic().result == RunResult::REJECTED);
+                REQUIRE(m.run() == RunResult::REJECTED);
+                REQUIRE(!m.is_finished_successfuly());
+            }
+        }
+    }
+}
+
+SCENARIO("Run compiled machine as threaded code") {
+    GIVEN("Machine scanning ones to the right and rewriting zero") {
+        TuringMachine m;
+        m.start_state("scan");
+        m.add_transition(unique_ptr<Transition>(new Transition("scan", "1", "1", "R", "scan")));
+        m.add_transition(unique_ptr<Transition>(new Transition("scan", "0", "X", "L", "back")));
+        m.add_transition(unique_ptr<Transition>(new Transition("back", "1", "1", "S", "halt")));
+        m.add_tape(unique_ptr<Tape>(new Tape("1110")));
+        
+        WHEN("Compile the machine") {
+            shared_ptr<const Program> program = m.compile();
+            int scan = program->get_start_state();
+            int back = program->lookup(scan, '0').next;
+            
+            THEN("Every instruction must have operation of its transition") {
+                REQUIRE(program->fetch(scan, '1').operation == Program::Operation::SWEEP_RIGHT);
+                REQUIRE(program->fetch(scan, '0').operation == Program::Operation::LEFT);
+                REQUIRE(program->fetch(scan, ' ').operation == Program::Operation::STOP);
+                REQUIRE(program->fetch(back, '1').operation == Program::Operation::STAY);
+                REQUIRE(program->fetch(TuringMachine::HALT, '1').operation == Program::Operation::STOP);
+                
+                REQUIRE(m.run() == RunResult::ACCEPTED);
+                REQUIRE(m.get_steps() == 5);
+                std::stringstream output;
+                output << *m.get_tape(0);
+                REQUIRE(output.str() == "111X");
+            }
+        }
     }
 }
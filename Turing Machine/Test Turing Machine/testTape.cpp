@@ -9,6 +9,8 @@
 #include "catch.hpp"
 #include "tm.hpp"
 
+#include <sstream>
+
 SCENARIO("Navigate trhough tape") {
     GIVEN("Tape with some initial data") {
         Tape t("123");
@@ -70,3 +72,128 @@ SCENARIO("Change values of tape") {
         
     }
 }
+
+SCENARIO("Grow tape across pages") {
+    GIVEN("Tape with some initial data") {
+        Tape t("12");
+        
+        WHEN("Write symbols far to the left and to the right") {
+            for (int e = 0; e < 3 * Tape::PAGE_SIZE; ++e) {
+                t.move_left();
+            }
+            t.write('L');
+            
+            for (int e = 0; e < 6 * Tape::PAGE_SIZE; ++e) {
+                t.move_right();
+            }
+            t.write('R');
+            
+            THEN("Tape must keep all symbols in order") {
+                std::stringstream sstream;
+                sstream << t;
+                
+                REQUIRE(sstream.str().compare("L12R") == 0);
+            }
+            
+            AND_THEN("Initial symbols must be at their places") {
+                for (int e = 0; e < 3 * Tape::PAGE_SIZE; ++e) {
+                    t.move_left();
+                }
+                REQUIRE(t.read() == '1');
+                
+                t.move_right();
+                REQUIRE(t.read() == '2');
+            }
+        }
+    }
+}
+
+SCENARIO("Run length encoded tape") {
+    GIVEN("Tape with long runs of equal symbols") {
+        Tape t("000111", Tape::Storage::RUN_LENGTH);
+        
+        REQUIRE(t.get_storage() == Tape::Storage::RUN_LENGTH);
+        
+        WHEN("Rewrite the middle of the runs") {
+            t.move_right();
+            t.move_right();
+            t.write('1');
+            t.move_right();
+            t.write('X');
+            
+            THEN("Symbols around the head must be kept") {
+                REQUIRE(t.read() == 'X');
+                
+                t.move_left();
+                REQUIRE(t.read() == '1');
+                
+                t.move_left();
+                REQUIRE(t.read() == '0');
+            }
+            
+            AND_THEN("Tape must be printed as before") {
+                std::stringstream sstream;
+                sstream << t;
+                
+                REQUIRE(sstream.str().compare("001X11") == 0);
+            }
+        }
+        
+        WHEN("Write over the left edge of the tape") {
+            t.move_left();
+            t.move_left();
+            t.write('L');
+            
+            THEN("Tape must grow to the left") {
+                std::stringstream sstream;
+                sstream << t;
+                
+                REQUIRE(sstream.str().compare("L000111") == 0);
+            }
+        }
+        
+        WHEN("Copy the tape") {
+            Tape copy(t);
+            copy.write('X');
+            
+            THEN("Copy must keep the storage and not change the original") {
+                REQUIRE(copy.get_storage() == Tape::Storage::RUN_LENGTH);
+                REQUIRE(t.read() == '0');
+            }
+        }
+    }
+}
+
+SCENARIO("Hash content of tape") {
+    GIVEN("Two tapes with hashing enabled") {
+        Tape first("abc", Tape::Storage::PAGED);
+        Tape second("xbc", Tape::Storage::RUN_LENGTH);
+        first.set_hashing(true);
+        second.set_hashing(true);
+        
+        WHEN("Tapes get the same content in different ways") {
+            first.write('x');
+            first.move_right();
+            second.move_right();
+            second.move_right();
+            second.write('d');
+            second.write('c');
+            second.move_left();
+            
+            THEN("Hashes must be equal") {
+                REQUIRE(first.get_hash() == second.get_hash());
+            }
+        }
+        
+        WHEN("Heads of the tapes are on different cells") {
+            first.write('x');
+            second.move_right();
+            
+            THEN("Hashes must differ") {
+                REQUIRE(first.get_hash() != second.get_hash());
+                second.move_left();
+                REQUIRE(first.get_hash() == second.get_hash());
+            }
+        }
+    }
+}
@@ -30,19 +30,21 @@ int main(int argc, const char * argv[]) {
     tm.print();
     
     tm.start_state("start");
-    tm.add_transition(unique_ptr<Transition>(new Transition("start", "0", "0", "R", "halt")));
+    tm.add_transition(unique_ptr<Transition>(new Transition("start", "00", "00", "RS", "halt")));
 //    tm.add_transition(unique_ptr<Transition>(new Transition("start", '1', 'X', 'R', "halt")));
     
 //    tm.loop_over("start", new Transition("start", '1', 'X', 'R', "halt"));
 
     TuringMachine tm2;
     tm2.start_state("start2");
-    tm2.add_transition(unique_ptr<Transition>(new Transition("start2", "0", "X", "R", "start")));
-    tm2.add_transition(unique_ptr<Transition>(new Transition("start2", "1", "1", "N", "halt")));
+    tm2.add_transition(unique_ptr<Transition>(new Transition("start2", "00", "X0", "RS", "start")));
+    tm2.add_transition(unique_ptr<Transition>(new Transition("start2", "10", "10", "SS", "halt")));
+    tm2.add_transition(unique_ptr<Transition>(new Transition("start", "00", "00", "RS", "start2")));
     
     tm.compose(tm2);
     
     tm.print();
+    tm.set_trace(TuringMachine::Trace::FULL);
     tm.run();
     tm.print();
     
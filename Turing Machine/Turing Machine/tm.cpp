@@ -9,16 +9,586 @@
 #include "tm.hpp"
 
 #include <algorithm>
+#include <iterator>
 #include <fstream>
 #include <sstream>
-#include <regex>
 #include <string>
+#include <cstring>
+#include <cstddef>
+#include <thread>
+#include <atomic>
+#include <mutex>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define TM_HAS_MMAP 1
+#endif
 
 const char Tape::EMPTY;
+const int Tape::PAGE_SIZE;
+
+//
+// Mix bits of 64 bit value
+//
+// Finalizer of splitmix64, every input bit affects every output bit.
+//
+static uint64_t mix(uint64_t value) {
+    value ^= value >> 30;
+    value *= 0xbf58476d1ce4e5b9ULL;
+    value ^= value >> 27;
+    value *= 0x94d049bb133111ebULL;
+    value ^= value >> 31;
+    return value;
+}
+
+//
+// Zobrist key of symbol at position of the tape
+//
+// EMPTY cells have key 0, so growing the tape does not change its hash.
+//
+static uint64_t cell_hash(long position, char symbol) {
+    return symbol == Tape::EMPTY ? 0 : mix(((uint64_t) position << 8) ^ (unsigned char) symbol);
+}
+
+//
+// Storage of tape symbols
+//
+// Storages keep their own head and are always created
+// with the head on the first symbol of the input.
+//
+class TapeStorage {
+public:
+    virtual ~TapeStorage() {}
+    
+    virtual char read() const = 0;
+    virtual void write(char) = 0;
+    virtual void move_left() = 0;
+    virtual void move_right() = 0;
+    
+    //
+    // Sweep the head over run of given symbol
+    //
+    // Writes the second symbol over every cell of the run and moves
+    // in given direction until the head reads different symbol
+    // or given count of cells is swept. Returns count of cells swept.
+    //
+    virtual uint64_t sweep(char, char, int, uint64_t) = 0;
+    
+    //
+    // Get signed position of the head
+    //
+    // The first symbol of the input is at position 0.
+    //
+    virtual long position() const = 0;
+    
+    //
+    // Read symbol at any position without moving the head
+    //
+    virtual char at(long) const = 0;
+    
+    //
+    // First and last position of kept cells
+    //
+    virtual pair<long, long> bounds() const = 0;
+    
+    //
+    // Print all non EMPTY symbols from left to right
+    //
+    virtual void print(ostream&) const = 0;
+    
+    virtual Tape::Storage kind() const = 0;
+    virtual unique_ptr<TapeStorage> clone() const = 0;
+    
+    //
+    // Compute hash of the whole content
+    //
+    virtual uint64_t content_hash() const = 0;
+    
+    void set_hashing(bool hashing) {
+        hashing_ = hashing;
+        hash_ = hashing ? content_hash() : 0;
+    }
+    
+    uint64_t hash() const {
+        return hash_;
+    }
+    
+protected:
+    
+    //
+    // Hash of the content, XOR of keys of all cells
+    //
+    // Updated by writes only while hashing is enabled.
+    //
+    bool hashing_ = false;
+    uint64_t hash_ = 0;
+    
+    void rehash(long position, char old, char symbol) {
+        hash_ ^= cell_hash(position, old) ^ cell_hash(position, symbol);
+    }
+};
+
+//
+// Paged storage
+//
+// Pages of PAGE_SIZE symbols, the head is page in pages_ and offset in that page.
+//
+class PagedStorage final : public TapeStorage {
+public:
+    PagedStorage(const string& input) {
+        do {
+            pages_.push_back(allocate_page());
+        } while (pages_.size() * Tape::PAGE_SIZE < input.length());
+        
+        for (size_t e = 0; e < input.length(); ++e) {
+            pages_[e / Tape::PAGE_SIZE][e % Tape::PAGE_SIZE] = input[e];
+        }
+        page_ = pages_[0].get();
+    }
+    
+    PagedStorage(const PagedStorage& other) : TapeStorage(other) {
+        for (const auto& page : other.pages_) {
+            pages_.push_back(unique_ptr<char[]>(new char[Tape::PAGE_SIZE]));
+            copy(page.get(), page.get() + Tape::PAGE_SIZE, pages_.back().get());
+        }
+        first_page_ = other.first_page_;
+        page_index_ = other.page_index_;
+        offset_ = other.offset_;
+        page_ = pages_[page_index_].get();
+    }
+    
+    char read() const override {
+        return page_[offset_];
+    }
+    
+    void write(char symbol) override {
+        if (hashing_) {
+            rehash(position(), page_[offset_], symbol);
+        }
+        page_[offset_] = symbol;
+    }
+    
+    void move_left() override {
+        if (offset_ == 0) {
+            turn_page(-1);
+        } else {
+            --offset_;
+        }
+    }
+    
+    void move_right() override {
+        if (++offset_ == Tape::PAGE_SIZE) {
+            turn_page(1);
+        }
+    }
+    
+    uint64_t sweep(char symbol, char write, int direction, uint64_t limit) override {
+        uint64_t count = 0;
+        
+        // Scan whole page at once and turn the page only at its edge
+        if (direction > 0) {
+            for (;;) {
+                while (offset_ < Tape::PAGE_SIZE && count < limit && page_[offset_] == symbol) {
+                    if (hashing_) {
+                        rehash(position(), symbol, write);
+                    }
+                    page_[offset_++] = write;
+                    ++count;
+                }
+                if (offset_ < Tape::PAGE_SIZE) {
+                    return count;
+                }
+                turn_page(1);
+            }
+        }
+        
+        for (;;) {
+            while (offset_ >= 0 && count < limit && page_[offset_] == symbol) {
+                if (hashing_) {
+                    rehash(position(), symbol, write);
+                }
+                page_[offset_--] = write;
+                ++count;
+            }
+            if (offset_ >= 0) {
+                return count;
+            }
+            turn_page(-1);
+        }
+    }
+    
+    long position() const override {
+        return (first_page_ + (long) page_index_) * Tape::PAGE_SIZE + offset_;
+    }
+    
+    char at(long position) const override {
+        long page = (position >= 0 ? position / Tape::PAGE_SIZE : -((-position - 1) / Tape::PAGE_SIZE) - 1);
+        long index = page - first_page_;
+        
+        if (index < 0 || index >= (long) pages_.size()) {
+            return Tape::EMPTY;
+        }
+        return pages_[index][position - page * Tape::PAGE_SIZE];
+    }
+    
+    pair<long, long> bounds() const override {
+        return { first_page_ * Tape::PAGE_SIZE, (first_page_ + (long) pages_.size()) * Tape::PAGE_SIZE - 1 };
+    }
+    
+    void print(ostream& out) const override {
+        for (const auto& page : pages_) {
+            for (int e = 0; e < Tape::PAGE_SIZE; ++e) {
+                if (page[e] != Tape::EMPTY) {
+                    out << page[e];
+                }
+            }
+        }
+    }
+    
+    Tape::Storage kind() const override {
+        return Tape::Storage::PAGED;
+    }
+    
+    unique_ptr<TapeStorage> clone() const override {
+        return unique_ptr<TapeStorage>(new PagedStorage(*this));
+    }
+    
+    uint64_t content_hash() const override {
+        uint64_t hash = 0;
+        for (size_t page = 0; page < pages_.size(); ++page) {
+            for (int e = 0; e < Tape::PAGE_SIZE; ++e) {
+                hash ^= cell_hash((first_page_ + (long) page) * Tape::PAGE_SIZE + e, pages_[page][e]);
+            }
+        }
+        return hash;
+    }
+    
+private:
+    deque<unique_ptr<char[]>> pages_;
+    
+    //
+    // Page number of the first page, negative when
+    // the tape has grown to the left of its start
+    //
+    long first_page_ = 0;
+    
+    size_t page_index_ = 0;
+    int offset_ = 0;
+    char* page_ = nullptr;
+    
+    //
+    // Move the head to the next page in given direction,
+    // allocating new page at the edge of the tape
+    //
+    void turn_page(int direction) {
+        if (direction > 0) {
+            if (++page_index_ == pages_.size()) {
+                pages_.push_back(allocate_page());
+            }
+            offset_ = 0;
+        } else {
+            if (page_index_ == 0) {
+                pages_.push_front(allocate_page());
+                --first_page_;
+            } else {
+                --page_index_;
+            }
+            offset_ = Tape::PAGE_SIZE - 1;
+        }
+        page_ = pages_[page_index_].get();
+    }
+    
+    static unique_ptr<char[]> allocate_page() {
+        unique_ptr<char[]> page(new char[Tape::PAGE_SIZE]);
+        fill(page.get(), page.get() + Tape::PAGE_SIZE, Tape::EMPTY);
+        return page;
+    }
+};
+
+//
+// Run length storage
+//
+// Runs of equal symbols covering the visited part of the tape,
+// neighbour runs always have different symbols.
+// The head is run in runs_ and offset in that run.
+//
+class RunLengthStorage final : public TapeStorage {
+public:
+    RunLengthStorage(const string& input) {
+        for (char symbol : input) {
+            if (!runs_.empty() && runs_.back().symbol == symbol) {
+                ++runs_.back().length;
+            } else {
+                runs_.push_back({ symbol, 1 });
+            }
+        }
+        
+        if (runs_.empty()) {
+            runs_.push_back({ Tape::EMPTY, 1 });
+        }
+    }
+    
+    char read() const override {
+        return runs_[run_].symbol;
+    }
+    
+    void write(char symbol) override {
+        if (hashing_) {
+            rehash(position_, runs_[run_].symbol, symbol);
+        }
+        assign(offset_, 1, symbol);
+    }
+    
+    void move_left() override {
+        --position_;
+        
+        if (offset_ > 0) {
+            --offset_;
+            return;
+        }
+        
+        if (run_ > 0) {
+            --run_;
+            offset_ = runs_[run_].length - 1;
+            return;
+        }
+        
+        // Grow the tape to the left
+        --start_;
+        seek_run_ = 0;
+        seek_start_ = start_;
+        if (runs_[0].symbol == Tape::EMPTY) {
+            ++runs_[0].length;
+        } else {
+            runs_.insert(runs_.begin(), { Tape::EMPTY, 1 });
+        }
+    }
+    
+    void move_right() override {
+        ++position_;
+        
+        if (offset_ + 1 < runs_[run_].length) {
+            ++offset_;
+            return;
+        }
+        
+        if (run_ + 1 == runs_.size()) {
+            // Grow the tape to the right
+            if (runs_[run_].symbol == Tape::EMPTY) {
+                ++runs_[run_].length;
+                ++offset_;
+                return;
+            }
+            runs_.push_back({ Tape::EMPTY, 1 });
+        }
+        
+        ++run_;
+        offset_ = 0;
+    }
+    
+    uint64_t sweep(char symbol, char write, int direction, uint64_t limit) override {
+        uint64_t count = 0;
+        
+        while (count < limit && runs_[run_].symbol == symbol) {
+            bool edge = direction > 0 ? run_ + 1 == runs_.size() : run_ == 0;
+            
+            // EMPTY run at the edge of the tape has no end, take it cell by cell
+            if (edge && symbol == Tape::EMPTY) {
+                this->write(write);
+                move(direction);
+                ++count;
+                continue;
+            }
+            
+            // Take the rest of the run in single assignment
+            long cells = direction > 0 ? runs_[run_].length - offset_ : offset_ + 1;
+            if ((uint64_t) cells > limit - count) {
+                cells = (long) (limit - count);
+            }
+            if (hashing_) {
+                long from = direction > 0 ? position_ : position_ - cells + 1;
+                for (long cell = 0; cell < cells; ++cell) {
+                    rehash(from + cell, symbol, write);
+                }
+            }
+            assign(direction > 0 ? offset_ : offset_ - cells + 1, cells, write);
+            if (direction > 0) {
+                offset_ += cells - 1;
+                position_ += cells - 1;
+            } else {
+                position_ -= cells - 1;
+            }
+            move(direction);
+            count += cells;
+        }
+        
+        return count;
+    }
+    
+    long position() const override {
+        return position_;
+    }
+    
+    char at(long position) const override {
+        if (position < start_) {
+            return Tape::EMPTY;
+        }
+        
+        // Walk from the run found last time, lookups of nearby cells take few runs
+        while (position < seek_start_) {
+            --seek_run_;
+            seek_start_ -= runs_[seek_run_].length;
+        }
+        while (position >= seek_start_ + runs_[seek_run_].length) {
+            if (seek_run_ + 1 == runs_.size()) {
+                return Tape::EMPTY;
+            }
+            seek_start_ += runs_[seek_run_].length;
+            ++seek_run_;
+        }
+        return runs_[seek_run_].symbol;
+    }
+    
+    pair<long, long> bounds() const override {
+        long length = 0;
+        for (const auto& run : runs_) {
+            length += run.length;
+        }
+        return { start_, start_ + length - 1 };
+    }
+    
+    void print(ostream& out) const override {
+        for (const auto& run : runs_) {
+            if (run.symbol != Tape::EMPTY) {
+                for (long e = 0; e < run.length; ++e) {
+                    out << run.symbol;
+                }
+            }
+        }
+    }
+    
+    Tape::Storage kind() const override {
+        return Tape::Storage::RUN_LENGTH;
+    }
+    
+    unique_ptr<TapeStorage> clone() const override {
+        return unique_ptr<TapeStorage>(new RunLengthStorage(*this));
+    }
+    
+    uint64_t content_hash() const override {
+        uint64_t hash = 0;
+        long start = start_;
+        for (const auto& run : runs_) {
+            for (long cell = 0; run.symbol != Tape::EMPTY && cell < run.length; ++cell) {
+                hash ^= cell_hash(start + cell, run.symbol);
+            }
+            start += run.length;
+        }
+        return hash;
+    }
+    
+private:
+    struct Run {
+        char symbol;
+        long length;
+    };
+    
+    vector<Run> runs_;
+    size_t run_ = 0;
+    long offset_ = 0;
+    
+    //
+    // Position of the first run and of the head
+    //
+    long start_ = 0;
+    long position_ = 0;
+    
+    //
+    // Run and its position found by last at()
+    //
+    // Reset whenever runs change.
+    //
+    mutable size_t seek_run_ = 0;
+    mutable long seek_start_ = 0;
+    
+    void move(int direction) {
+        if (direction > 0) {
+            move_right();
+        } else {
+            move_left();
+        }
+    }
+    
+    //
+    // Assign symbol to cells of the current run
+    //
+    // Cells are given by offset in the run and count.
+    // The head is left on the first assigned cell.
+    //
+    void assign(long from, long count, char symbol) {
+        seek_run_ = 0;
+        seek_start_ = start_;
+        
+        Run& current = runs_[run_];
+        if (current.symbol == symbol) {
+            offset_ = from;
+            return;
+        }
+        
+        // Moving cells between neighbour runs is the common case of sweeping machines
+        if (count < current.length) {
+            if (from == 0 && run_ > 0 && runs_[run_ - 1].symbol == symbol) {
+                current.length -= count;
+                --run_;
+                offset_ = runs_[run_].length;
+                runs_[run_].length += count;
+                return;
+            }
+            
+            if (from + count == current.length && run_ + 1 < runs_.size() && runs_[run_ + 1].symbol == symbol) {
+                current.length -= count;
+                ++run_;
+                runs_[run_].length += count;
+                offset_ = 0;
+                return;
+            }
+        }
+        
+        // Split the run to cells before, assigned cells and cells after
+        char old = current.symbol;
+        long before = from;
+        long after = current.length - from - count;
+        
+        current = { symbol, count };
+        if (after > 0) {
+            runs_.insert(runs_.begin() + run_ + 1, { old, after });
+        }
+        if (before > 0) {
+            runs_.insert(runs_.begin() + run_, { old, before });
+            ++run_;
+        }
+        offset_ = 0;
+        
+        if (run_ + 1 < runs_.size() && runs_[run_ + 1].symbol == symbol) {
+            runs_[run_].length += runs_[run_ + 1].length;
+            runs_.erase(runs_.begin() + run_ + 1);
+        }
+        
+        if (run_ > 0 && runs_[run_ - 1].symbol == symbol) {
+            offset_ = runs_[run_ - 1].length;
+            runs_[run_ - 1].length += runs_[run_].length;
+            runs_.erase(runs_.begin() + run_);
+            --run_;
+        }
+    }
+};
 
-Tape::Tape(const string &input) {
+Tape::Tape(const string &input, Storage storage) {
     
-    if (input[0] == DELIMITER) {
+    if (!input.empty() && input[0] == DELIMITER) {
         // Multiple tapes so...
         stringstream ss(input);
         string item;
@@ -28,33 +598,49 @@ Tape::Tape(const string &input) {
                 continue;
             }
             
-            if (current_ == '\0') {
-                initialize(item);
+            if (!storage_) {
+                initialize(item, storage);
             } else {
-                virtual_tapes_.push_back(Tape(item));
+                virtual_tapes_.push_back(Tape(item, storage));
             }
         }
+        
+        if (!storage_) {
+            initialize("", storage);
+        }
         return;
     }
     
-    initialize(input);
+    initialize(input, storage);
 }
 
-void Tape::initialize(const string &input) {
-    for (int e = (int) (input.length() - 1); e >= 0; --e) {
-        right_.push_back(input[e]);
+void Tape::initialize(const string &input, Storage storage) {
+    switch (storage) {
+        case Storage::PAGED:
+            storage_.reset(new PagedStorage(input));
+            break;
+        case Storage::RUN_LENGTH:
+            storage_.reset(new RunLengthStorage(input));
+            break;
     }
-    current_ = right_.back();
-    right_.pop_back();
 }
 
-Tape::Tape(const Tape &other) {
-    left_ = other.left_;
-    right_ = other.right_;
-    current_ = other.current_;
-    virtual_tapes_ = other.virtual_tapes_;
+Tape::Tape(const Tape &other) : virtual_tapes_(other.virtual_tapes_), storage_(other.storage_->clone())
+{}
+
+Tape::Tape(Tape&&) = default;
+
+Tape::~Tape() = default;
+
+Tape& Tape::operator=(const Tape &other) {
+    if (this != &other) {
+        *this = Tape(other);
+    }
+    return *this;
 }
 
+Tape& Tape::operator=(Tape&&) = default;
+
 void Tape::move_left(int index) {
     
     // Handle moving left of virtual tape
@@ -63,12 +649,7 @@ void Tape::move_left(int index) {
         return;
     }
     
-    right_.push_back(current_);
-    if (left_.empty()) {
-        left_.push_back(EMPTY);
-    }
-    current_ = left_.back();
-    left_.pop_back();
+    storage_->move_left();
 }
 
 void Tape::move_right(int index) {
@@ -79,12 +660,7 @@ void Tape::move_right(int index) {
         return;
     }
     
-    left_.push_back(current_);
-    if (right_.empty()) {
-        right_.push_back(EMPTY);
-    }
-    current_ = right_.back();
-    right_.pop_back();
+    storage_->move_right();
 }
 
 void Tape::write(char symbol, int index) {
@@ -95,7 +671,7 @@ void Tape::write(char symbol, int index) {
         return;
     }
     
-    current_ = symbol;
+    storage_->write(symbol);
 }
 
 char Tape::read(int index) const {
@@ -104,32 +680,63 @@ char Tape::read(int index) const {
         return virtual_tapes_[index].read();
     }
     
-    return current_;
+    return storage_->read();
 }
 
-ostream& operator<<(ostream& out, Tape &tape) {
+void Tape::append_tracks(Tape&& tape) {
+    vector<Tape> tracks = std::move(tape.virtual_tapes_);
+    tape.virtual_tapes_.clear();
     
-    if (tape.virtual_tapes_.size() > 0) {
-        cout << '#';
+    virtual_tapes_.push_back(std::move(tape));
+    for (auto& track : tracks) {
+        virtual_tapes_.push_back(std::move(track));
     }
-   
-    for (vector<char>::iterator it = tape.left_.begin(); it != tape.left_.end(); ++it) {
-        if ((*it) != Tape::EMPTY) {
-            out << *it;
-        }
+}
+
+void Tape::set_hashing(bool hashing) {
+    storage_->set_hashing(hashing);
+    for (auto& tape : virtual_tapes_) {
+        tape.set_hashing(hashing);
     }
+}
 
-    if (tape.current_ != Tape::EMPTY) {
-        out << tape.current_;
+uint64_t Tape::get_hash() const {
+    uint64_t hash = storage_->hash() ^ mix((uint64_t) storage_->position() ^ 0x9e3779b97f4a7c15ULL);
+    for (const auto& tape : virtual_tapes_) {
+        hash = mix(hash) ^ tape.get_hash();
     }
+    return hash;
+}
 
-    for (vector<char>::reverse_iterator it = tape.right_.rbegin(); it != tape.right_.rend(); ++it) {
-        if ((*it) != Tape::EMPTY) {
-            out << *it;
-        }
+long Tape::get_position() const {
+    return storage_->position();
+}
+
+char Tape::at(long position) const {
+    return storage_->at(position);
+}
+
+pair<long, long> Tape::get_bounds() const {
+    return storage_->bounds();
+}
+
+int Tape::get_tracks_count() const {
+    return 1 + (int) virtual_tapes_.size();
+}
+
+Tape::Storage Tape::get_storage() const {
+    return storage_->kind();
+}
+
+ostream& operator<<(ostream& out, Tape &tape) {
+    
+    if (tape.virtual_tapes_.size() > 0) {
+        out << '#';
     }
     
-    for (auto tape : tape.virtual_tapes_) {
+    tape.storage_->print(out);
+    
+    for (auto& tape : tape.virtual_tapes_) {
         out << '#';
         out << tape;
     }
@@ -149,10 +756,12 @@ Transition::Transition(const Transition &other) {
     write_ = other.write_;
     next_state_ = other.next_state_;
     command_ = other.command_;
+    current_id_ = other.current_id_;
+    next_id_ = other.next_id_;
 }
 
 char Transition::get_command(int tape = 0) const {
-    return tape > command_.size() - 1 ? '\0' : command_[tape];
+    return tape >= (int) command_.size() ? '\0' : command_[tape];
 }
 
 string Transition::get_command() const {
@@ -160,7 +769,7 @@ string Transition::get_command() const {
 }
 
 char Transition::get_read_symbol(int tape = 0) const {
-    return tape > read_.size() - 1 ? '\0' :read_[tape];
+    return tape >= (int) read_.size() ? '\0' : read_[tape];
 }
 
 string Transition::get_read_symbols() const {
@@ -168,7 +777,7 @@ string Transition::get_read_symbols() const {
 }
 
 char Transition::get_write_symbol(int tape = 0) const {
-    return tape > write_.size() - 1 ? '\0' :write_[tape];
+    return tape >= (int) write_.size() ? '\0' : write_[tape];
 }
 
 string Transition::get_write_symbols() const {
@@ -192,112 +801,1860 @@ ostream& operator<<(ostream& out, Transition &transition) {
     return out;
 }
 
-TuringMachine::TuringMachine() : current_state_("halt")
-{}
+int Program::get_states_count() const {
+    return (int) states_.size();
+}
 
-TuringMachine::TuringMachine(const TuringMachine &other) {
-    current_state_ = other.current_state_;
-    
-    for (const auto& e : other.tapes_) {
-        tapes_.push_back(make_unique<Tape>(*e));
-    }
-    
-    for (const auto& imap: other.mapping_) {
-        for (const auto& itrans: imap.second) {
-             mapping_[imap.first].push_back(make_unique<Transition>(*itrans));
+const string& Program::get_state_name(int state) const {
+    return states_[state];
+}
+
+string Program::get_alphabet() const {
+    string alphabet;
+    for (int symbol = 0; symbol < 256; ++symbol) {
+        if (columns_[symbol] != 0) {
+            alphabet.push_back((char) symbol);
         }
     }
+    return alphabet;
 }
 
-void TuringMachine::add_tape(unique_ptr<Tape> tape) {
-    tapes_.push_back(std::move(tape));
+int Program::get_start_state() const {
+    return start_;
 }
 
-Tape* TuringMachine::get_tape(int index) {
-    return tapes_[index].get();
+void Program::thread() {
+    code_.resize(table_.size());
+    
+    for (size_t cell = 0; cell < table_.size(); ++cell) {
+        const Entry& entry = table_[cell];
+        int state = (int) (cell / alphabet_size_);
+        Instruction& instruction = code_[cell];
+        instruction.next = entry.next;
+        instruction.write = entry.write;
+        
+        if (get_halting(state) != Halting::NONE || entry.next == TuringMachine::STUCK) {
+            instruction.operation = Operation::STOP;
+        } else if (entry.next == state && entry.move != 0) {
+            instruction.operation = entry.move > 0 ? Operation::SWEEP_RIGHT : Operation::SWEEP_LEFT;
+        } else {
+            instruction.operation = entry.move > 0 ? Operation::RIGHT : entry.move < 0 ? Operation::LEFT : Operation::STAY;
+        }
+    }
 }
 
-void TuringMachine::remove_tape(int index) {
-    tapes_.erase(tapes_.begin() + 1);
+//
+// Result of run stopped in state of given halting kind
+//
+static RunResult halting_result(Program::Halting halting) {
+    switch (halting) {
+        case Program::Halting::ACCEPT:
+            return RunResult::ACCEPTED;
+        case Program::Halting::REJECT:
+            return RunResult::REJECTED;
+        default:
+            return RunResult::STUCK;
+    }
 }
 
-void TuringMachine::start_state(const string& state) {
-    current_state_ = state;
-}
+//
+// Steps between two checks of the deadline
+//
+const static uint64_t DEADLINE_INTERVAL = 1 << 16;
 
-void TuringMachine::add_transition(unique_ptr<Transition> transition) {
-            
-    mapping_[transition.get()->get_current_state()].push_back(std::move(transition));
-}
+//
+// Execute program on concrete tape storage
+//
+// Runs until the machine stops or executes given count of steps.
+// Instantiated for every storage so the calls in the loop are not virtual.
+//
+// The program runs as threaded code: every operation ends by fetching the
+// next instruction and jumping straight to its operation, by computed goto
+// where the compiler has labels as values and by switch elsewhere.
+// Halting states have only STOP instructions, so the state itself
+// is never checked. Define TM_NO_COMPUTED_GOTO to build the switch.
+//
+#if defined(__GNUC__) && !defined(TM_NO_COMPUTED_GOTO)
+#define TM_COMPUTED_GOTO 1
+#endif
 
-Transition* TuringMachine::find_transitions(const char &input) {
-    
-    const auto& transitions = mapping_[current_state_];
+#ifdef TM_COMPUTED_GOTO
+#define TM_OPERATION(operation) operation_##operation
+#define TM_DISPATCH() \
+    do { \
+        if (executed >= stop) { \
+            goto finish; \
+        } \
+        instruction = &program.fetch(current, tape.read()); \
+        goto *operations[(int) instruction->operation]; \
+    } while (0)
+#else
+#define TM_OPERATION(operation) case Program::Operation::operation
+#define TM_DISPATCH() continue
+#endif
+
+template<typename Storage>
+static void execute(const Program& program, Storage& tape, int& state, uint64_t& steps, uint64_t stop) {
+    int current = state;
+    uint64_t executed = steps;
+    const Program::Instruction* instruction = nullptr;
     
-    for (const auto& transition : transitions) {
-        if (transition->get_read_symbol() == input) {
-            return transition.get();
-        }
+    if (program.get_halting(current) != Program::Halting::NONE) {
+        return;
     }
     
+#ifdef TM_COMPUTED_GOTO
+    static const void* const operations[] = {
+        &&TM_OPERATION(STOP), &&TM_OPERATION(STAY), &&TM_OPERATION(LEFT),
+        &&TM_OPERATION(RIGHT), &&TM_OPERATION(SWEEP_LEFT), &&TM_OPERATION(SWEEP_RIGHT)
+    };
+    TM_DISPATCH();
+    {
+#else
+    for (;;) {
+        if (executed >= stop) {
+            goto finish;
+        }
+        instruction = &program.fetch(current, tape.read());
+        
+        switch (instruction->operation) {
+#endif
+        TM_OPERATION(STAY):
+            tape.write(instruction->write);
+            current = instruction->next;
+            ++executed;
+            TM_DISPATCH();
+            
+        TM_OPERATION(LEFT):
+            tape.write(instruction->write);
+            tape.move_left();
+            current = instruction->next;
+            ++executed;
+            TM_DISPATCH();
+            
+        TM_OPERATION(RIGHT):
+            tape.write(instruction->write);
+            tape.move_right();
+            current = instruction->next;
+            ++executed;
+            TM_DISPATCH();
+            
+        // Self loop moving in one direction, like 1{scan} -> 1{scan}R,
+        // sweeps the whole run of the symbol in one go
+        TM_OPERATION(SWEEP_LEFT):
+            executed += tape.sweep(tape.read(), instruction->write, -1, stop - executed);
+            TM_DISPATCH();
+            
+        TM_OPERATION(SWEEP_RIGHT):
+            executed += tape.sweep(tape.read(), instruction->write, 1, stop - executed);
+            TM_DISPATCH();
+            
+        TM_OPERATION(STOP):
+            if (program.get_halting(current) == Program::Halting::NONE) {
+                current = TuringMachine::STUCK;
+            }
+            goto finish;
+#ifndef TM_COMPUTED_GOTO
+        }
+#endif
+    }
+    
+finish:
+    state = current;
+    steps = executed;
+}
+
+#undef TM_OPERATION
+#undef TM_DISPATCH
+
+//
+// Cycle detector
+//
+// Brent's algorithm: snapshot of the configuration is taken after
+// 1, 2, 4, 8... steps and every following configuration is compared to it.
+// Count of cells where the tape differs from the snapshot is kept on every
+// write, so comparing configurations is constant time.
+//
+template<typename Storage>
+class CycleDetector {
+public:
+    CycleDetector(const Storage& tape, int state) {
+        take_snapshot(tape, state);
+    }
+    
+    //
+    // Execute program like execute() does, cell by cell
+    //
+    // Returns true as soon as configuration repeats.
+    //
+    bool execute(const Program& program, Storage& tape, int& state, uint64_t& steps, uint64_t stop) {
+        while (steps < stop && program.get_halting(state) == Program::Halting::NONE) {
+            char symbol = tape.read();
+            const Program::Entry& next = program.lookup(state, symbol);
+            
+            if (next.next == TuringMachine::STUCK) {
+                state = TuringMachine::STUCK;
+                break;
+            }
+            
+            if (next.write != symbol) {
+                char original = snapshot_->at(tape.position());
+                differences_ += (next.write != original) - (symbol != original);
+                tape.write(next.write);
+            }
+            
+            if (next.move > 0) {
+                tape.move_right();
+            } else if (next.move < 0) {
+                tape.move_left();
+            }
+            state = next.next;
+            ++steps;
+            
+            if (differences_ == 0 && state == state_ && tape.position() == position_) {
+                return true;
+            }
+            
+            if (++length_ == power_) {
+                take_snapshot(tape, state);
+                power_ *= 2;
+                length_ = 0;
+            }
+        }
+        return false;
+    }
+    
+private:
+    unique_ptr<Storage> snapshot_;
+    int state_;
+    long position_;
+    long differences_ = 0;
+    uint64_t power_ = 1;
+    uint64_t length_ = 0;
+    
+    void take_snapshot(const Storage& tape, int state) {
+        snapshot_.reset(new Storage(tape));
+        state_ = state;
+        position_ = tape.position();
+        differences_ = 0;
+    }
+};
+
+//
+// Run program on concrete tape storage within limits
+//
+template<typename Storage>
+static RunResult run_limited(const Program& program, Storage& tape, int& state, uint64_t& steps, const Program::Options& options) {
+    bool timed = options.deadline != chrono::steady_clock::time_point::max();
+    unique_ptr<CycleDetector<Storage>> detector;
+    if (options.detect_cycles) {
+        detector.reset(new CycleDetector<Storage>(tape, state));
+    }
+    
+    for (;;) {
+        uint64_t stop = options.max_steps;
+        if (timed && stop - steps > DEADLINE_INTERVAL) {
+            stop = steps + DEADLINE_INTERVAL;
+        }
+        
+        if (detector) {
+            if (detector->execute(program, tape, state, steps, stop)) {
+                return RunResult::LOOPING;
+            }
+        } else {
+            execute(program, tape, state, steps, stop);
+        }
+        
+        if (program.get_halting(state) != Program::Halting::NONE) {
+            return halting_result(program.get_halting(state));
+        }
+        if (steps >= options.max_steps) {
+            return RunResult::STEP_LIMIT;
+        }
+        if (timed && chrono::steady_clock::now() >= options.deadline) {
+            return RunResult::TIMEOUT;
+        }
+    }
+}
+
+RunResult Program::run(Tape &tape, int& state, uint64_t& steps, const Options& options) const {
+    steps = 0;
+    
+    switch (tape.get_storage()) {
+        case Tape::Storage::PAGED:
+            return run_limited(*this, static_cast<PagedStorage&>(*tape.storage_), state, steps, options);
+        case Tape::Storage::RUN_LENGTH:
+            return run_limited(*this, static_cast<RunLengthStorage&>(*tape.storage_), state, steps, options);
+    }
+    return RunResult::STUCK;
+}
+
+Execution::Execution(shared_ptr<const Program> program, const string& input, Tape::Storage storage) :
+    program_(program), tape_(input, storage), state_(program->get_start_state())
+{}
+
+const Program& Execution::get_program() const {
+    return *program_;
+}
+
+Tape& Execution::get_tape() {
+    return tape_;
+}
+
+int Execution::get_state() const {
+    return state_;
+}
+
+uint64_t Execution::get_steps() const {
+    return steps_;
+}
+
+bool Execution::is_finished_successfuly() const {
+    return program_->get_halting(state_) == Program::Halting::ACCEPT;
+}
+
+bool Execution::step() {
+    if (program_->get_halting(state_) != Program::Halting::NONE) {
+        return false;
+    }
+    
+    const Program::Entry& next = program_->lookup(state_, tape_.read());
+    if (next.next == TuringMachine::STUCK) {
+        state_ = TuringMachine::STUCK;
+        return false;
+    }
+    
+    tape_.write(next.write);
+    if (next.move > 0) {
+        tape_.move_right();
+    } else if (next.move < 0) {
+        tape_.move_left();
+    }
+    state_ = next.next;
+    ++steps_;
+    return true;
+}
+
+RunResult Execution::run(const Program::Options& options) {
+    uint64_t steps;
+    RunResult result = program_->run(tape_, state_, steps, options);
+    steps_ += steps;
+    return result;
+}
+
+BatchRunner::BatchRunner(shared_ptr<const Program> program, unsigned threads) : program_(program), threads_(threads) {
+    if (threads_ == 0) {
+        threads_ = max(1u, thread::hardware_concurrency());
+    }
+}
+
+void BatchRunner::set_storage(Tape::Storage storage) {
+    storage_ = storage;
+}
+
+//
+// Block of inputs dealt to single worker
+//
+// The owner takes inputs from the front, thieves from the back.
+//
+struct BatchBlock {
+    mutex lock;
+    size_t begin;
+    size_t end;
+};
+
+static bool take_input(BatchBlock& block, bool steal, size_t& input) {
+    lock_guard<mutex> guard(block.lock);
+    if (block.begin == block.end) {
+        return false;
+    }
+    input = steal ? --block.end : block.begin++;
+    return true;
+}
+
+vector<BatchResult> BatchRunner::run(const vector<string>& inputs, const Program::Options& options) const {
+    vector<BatchResult> results(inputs.size());
+    size_t workers = min<size_t>(threads_, max<size_t>(inputs.size(), 1));
+    
+    vector<BatchBlock> blocks(workers);
+    for (size_t w = 0; w < workers; ++w) {
+        blocks[w].begin = inputs.size() * w / workers;
+        blocks[w].end = inputs.size() * (w + 1) / workers;
+    }
+    
+    auto work = [&](size_t worker) {
+        size_t input;
+        for (;;) {
+            bool found = take_input(blocks[worker], false, input);
+            for (size_t w = 1; !found && w < workers; ++w) {
+                found = take_input(blocks[(worker + w) % workers], true, input);
+            }
+            if (!found) {
+                return;
+            }
+            
+            Execution execution(program_, inputs[input], storage_);
+            BatchResult& result = results[input];
+            result.result = execution.run(options);
+            result.steps = execution.get_steps();
+            
+            stringstream output;
+            output << execution.get_tape();
+            result.output = output.str();
+        }
+    };
+    
+    vector<thread> pool;
+    for (size_t w = 1; w < workers; ++w) {
+        pool.emplace_back(work, w);
+    }
+    work(0);
+    for (auto& worker : pool) {
+        worker.join();
+    }
+    
+    return results;
+}
+
+const int MultiTapeProgram::MAX_TAPES;
+
+//
+// Hash of state and packed read symbols
+//
+static uint64_t slot_hash(int state, uint64_t key) {
+    return mix(key ^ ((uint64_t) (uint32_t) state << 32 | (uint32_t) state));
+}
+
+int MultiTapeProgram::get_tapes_count() const {
+    return tapes_;
+}
+
+const MultiTapeProgram::Record* MultiTapeProgram::lookup(int state, uint64_t key) const {
+    size_t mask = slots_.size() - 1;
+    for (size_t slot = slot_hash(state, key) & mask; slots_[slot].record >= 0; slot = (slot + 1) & mask) {
+        if (slots_[slot].key == key && slots_[slot].state == state) {
+            return &records_[slots_[slot].record];
+        }
+    }
     return nullptr;
 }
 
-vector<string> TuringMachine::get_states() {
-    vector<string> keys;
+//
+// Run multiple tape program on tapes of concrete storage within limits
+//
+// Storage is TapeStorage itself when the tapes are of different kinds.
+//
+template<typename Storage>
+static RunResult run_tapes(const MultiTapeProgram& program, Storage* const* storages, int& state, uint64_t& steps, const Program::Options& options) {
+    int tapes = program.get_tapes_count();
+    
+    // Heads and symbols under them are kept together for the whole run
+    uint64_t key = 0;
+    for (int t = 0; t < tapes; ++t) {
+        key |= (uint64_t) (unsigned char) storages[t]->read() << (8 * t);
+    }
+    
+    bool timed = options.deadline != chrono::steady_clock::time_point::max();
+    steps = 0;
+    
+    for (;;) {
+        uint64_t stop = options.max_steps;
+        if (timed && stop - steps > DEADLINE_INTERVAL) {
+            stop = steps + DEADLINE_INTERVAL;
+        }
+        
+        for (; steps < stop; ++steps) {
+            if (program.get_halting(state) != Program::Halting::NONE) {
+                return halting_result(program.get_halting(state));
+            }
+            
+            const MultiTapeProgram::Record* record = program.lookup(state, key);
+            if (record == nullptr) {
+                state = TuringMachine::STUCK;
+                return RunResult::STUCK;
+            }
+            
+            for (int t = 0; t < tapes; ++t) {
+                uint8_t bit = (uint8_t) (1 << t);
+                if (record->write_mask & bit) {
+                    storages[t]->write(record->write[t]);
+                }
+                if (record->left_mask & bit) {
+                    storages[t]->move_left();
+                } else if (record->right_mask & bit) {
+                    storages[t]->move_right();
+                } else if (!(record->write_mask & bit)) {
+                    continue;
+                }
+                key = (key & ~((uint64_t) 0xff << (8 * t))) | (uint64_t) (unsigned char) storages[t]->read() << (8 * t);
+            }
+            state = record->next;
+        }
+        
+        if (program.get_halting(state) != Program::Halting::NONE) {
+            return halting_result(program.get_halting(state));
+        }
+        if (steps >= options.max_steps) {
+            return RunResult::STEP_LIMIT;
+        }
+        if (timed && chrono::steady_clock::now() >= options.deadline) {
+            return RunResult::TIMEOUT;
+        }
+    }
+}
+
+//
+// Cast storages of all tapes to the same concrete storage
+//
+template<typename Storage>
+static RunResult run_tapes(const MultiTapeProgram& program, TapeStorage* const* tapes, int& state, uint64_t& steps, const Program::Options& options) {
+    Storage* storages[MultiTapeProgram::MAX_TAPES];
+    for (int t = 0; t < program.get_tapes_count(); ++t) {
+        storages[t] = static_cast<Storage*>(tapes[t]);
+    }
+    return run_tapes(program, storages, state, steps, options);
+}
+
+RunResult MultiTapeProgram::run(const vector<unique_ptr<Tape>>& tapes, int& state, uint64_t& steps, const Program::Options& options) const {
+    TapeStorage* storages[MAX_TAPES];
+    Tape::Storage kind = tapes_ > 0 ? tapes[0]->get_storage() : Tape::Storage::PAGED;
+    bool same = true;
+    for (int t = 0; t < tapes_; ++t) {
+        storages[t] = tapes[t]->storage_.get();
+        same = same && tapes[t]->get_storage() == kind;
+    }
+    
+    // Tapes of the same kind are run without virtual calls, like single tape programs
+    if (same && kind == Tape::Storage::PAGED) {
+        return run_tapes<PagedStorage>(*this, storages, state, steps, options);
+    }
+    if (same && kind == Tape::Storage::RUN_LENGTH) {
+        return run_tapes<RunLengthStorage>(*this, storages, state, steps, options);
+    }
+    return run_tapes(*this, storages, state, steps, options);
+}
+
+//
+// Configurations of single chunk of a level expanded by one worker
+//
+struct SearchChunk {
+    struct Link {
+        uint32_t parent;
+        int choice;
+        int state;
+    };
+    
+    vector<Tape> tapes;
+    vector<Link> links;
+    
+    //
+    // Hash and rank of every configuration, used to find which one
+    // of equal configurations is kept
+    //
+    vector<uint64_t> hashes;
+    vector<uint64_t> ranks;
+};
+
+//
+// Visited set of configuration hashes
+//
+// Split to shards with their own locks, so workers rarely wait for each other.
+// Every hash remembers the level where it was seen first and the smallest rank
+// of configuration with that hash in the level. Ranks follow order of
+// sequential search, so the configuration kept from equal ones does not
+// depend on order in which the workers reach them.
+//
+class VisitedSet {
+public:
+    
+    //
+    // Insert hash of configuration of given level and rank
+    //
+    // Returns false if equal configuration was seen in earlier level
+    // or with smaller rank in this level.
+    //
+    bool insert(uint64_t hash, uint64_t level, uint64_t rank) {
+        Shard& shard = shards_[hash >> 58];
+        lock_guard<mutex> guard(shard.lock);
+        
+        auto inserted = shard.seen.insert({ hash, { level, rank } });
+        Seen& seen = inserted.first->second;
+        if (inserted.second) {
+            return true;
+        }
+        if (seen.level < level || seen.rank < rank) {
+            return false;
+        }
+        seen.rank = rank;
+        return true;
+    }
+    
+    //
+    // Check if configuration of given rank is the one kept for its hash
+    //
+    bool owns(uint64_t hash, uint64_t rank) {
+        Shard& shard = shards_[hash >> 58];
+        lock_guard<mutex> guard(shard.lock);
+        return shard.seen[hash].rank == rank;
+    }
+    
+private:
+    struct Seen {
+        uint64_t level;
+        uint64_t rank;
+    };
+    
+    struct Shard {
+        mutex lock;
+        unordered_map<uint64_t, Seen> seen;
+    };
+    
+    Shard shards_[64];
+};
+
+//
+// Hash of configuration of nondeterministic machine
+//
+static uint64_t configuration_hash(const Tape& tape, int state) {
+    return mix(tape.get_hash() ^ ((uint64_t) (uint32_t) state << 32));
+}
+
+//
+// Configurations in a chunk of a level of the search
+//
+const static size_t SEARCH_CHUNK = 256;
+
+NondeterministicRunner::NondeterministicRunner(shared_ptr<const Program> program, unsigned threads) : program_(program), threads_(threads) {
+    if (threads_ == 0) {
+        threads_ = max(1u, thread::hardware_concurrency());
+    }
+}
+
+void NondeterministicRunner::set_deduplication(bool deduplication) {
+    deduplication_ = deduplication;
+}
+
+SearchResult NondeterministicRunner::run(const string& input, const Program::Options& options) const {
+    return run(Tape(input, Tape::Storage::RUN_LENGTH), program_->get_start_state(), options);
+}
+
+SearchResult NondeterministicRunner::run(const Tape& tape, int state, const Program::Options& options) const {
+    SearchResult result;
+    result.result = RunResult::STUCK;
+    result.configurations = 1;
+    
+    bool timed = options.deadline != chrono::steady_clock::time_point::max();
+    vector<Tape> tapes(1, tape);
+    vector<int> states(1, state);
+    vector<vector<SearchChunk::Link>> history;
+    
+    unique_ptr<VisitedSet> visited;
+    if (deduplication_) {
+        visited.reset(new VisitedSet());
+        tapes[0].set_hashing(true);
+        visited->insert(configuration_hash(tapes[0], state), 0, 0);
+    }
+    
+    if (program_->get_halting(state) != Program::Halting::NONE) {
+        result.result = halting_result(program_->get_halting(state));
+        stringstream output;
+        output << tapes[0];
+        result.output = output.str();
+        return result;
+    }
+    
+    for (uint64_t depth = 0; !tapes.empty(); ++depth) {
+        if (depth >= options.max_steps || result.configurations >= options.max_configurations) {
+            result.result = RunResult::STEP_LIMIT;
+            return result;
+        }
+        if (timed && chrono::steady_clock::now() >= options.deadline) {
+            result.result = RunResult::TIMEOUT;
+            return result;
+        }
+        
+        size_t chunks_count = (tapes.size() + SEARCH_CHUNK - 1) / SEARCH_CHUNK;
+        vector<SearchChunk> chunks(chunks_count);
+        atomic<size_t> next_chunk(0);
+        atomic<size_t> accepted(chunks_count);
+        atomic<bool> rejected(false);
+        
+        // Chunks after the first one with accepting configuration are not needed
+        auto work = [&]() {
+            for (size_t c = next_chunk++; c < chunks_count && c < accepted.load(); c = next_chunk++) {
+                SearchChunk& chunk = chunks[c];
+                size_t end = min(tapes.size(), (c + 1) * SEARCH_CHUNK);
+                uint64_t rank = (uint64_t) c << 32;
+                
+                for (size_t i = c * SEARCH_CHUNK; i < end; ++i) {
+                    auto choices = program_->choices(states[i], tapes[i].read());
+                    
+                    for (const Program::Entry* entry = choices.first; entry != choices.second; ++entry) {
+                        Program::Halting halting = program_->get_halting(entry->next);
+                        if (halting == Program::Halting::REJECT) {
+                            rejected = true;
+                            continue;
+                        }
+                        
+                        chunk.tapes.push_back(tapes[i]);
+                        Tape& child = chunk.tapes.back();
+                        child.write(entry->write);
+                        if (entry->move > 0) {
+                            child.move_right();
+                        } else if (entry->move < 0) {
+                            child.move_left();
+                        }
+                        chunk.links.push_back({ (uint32_t) i, (int) (entry - choices.first), entry->next });
+                        
+                        if (halting == Program::Halting::ACCEPT) {
+                            chunk.hashes.push_back(0);
+                            chunk.ranks.push_back(rank);
+                            
+                            size_t first = accepted.load();
+                            while (c < first && !accepted.compare_exchange_weak(first, c)) {}
+                            return;
+                        }
+                        
+                        if (visited) {
+                            uint64_t hash = configuration_hash(child, entry->next);
+                            if (!visited->insert(hash, depth + 1, ++rank)) {
+                                chunk.tapes.pop_back();
+                                chunk.links.pop_back();
+                                continue;
+                            }
+                            chunk.hashes.push_back(hash);
+                            chunk.ranks.push_back(rank);
+                        }
+                    }
+                }
+            }
+        };
+        
+        vector<thread> pool;
+        for (size_t w = 1; w < min<size_t>(threads_, chunks_count); ++w) {
+            pool.emplace_back(work);
+        }
+        work();
+        for (auto& worker : pool) {
+            worker.join();
+        }
+        
+        // Concatenate chunks in order to the next level
+        vector<SearchChunk::Link> links;
+        tapes.clear();
+        states.clear();
+        for (size_t c = 0; c < chunks_count && c <= accepted.load(); ++c) {
+            for (size_t i = 0; i < chunks[c].tapes.size(); ++i) {
+                
+                // Drop configurations equal to one with smaller rank
+                bool halted = program_->get_halting(chunks[c].links[i].state) == Program::Halting::ACCEPT;
+                if (visited && !halted && !visited->owns(chunks[c].hashes[i], chunks[c].ranks[i])) {
+                    continue;
+                }
+                
+                tapes.push_back(std::move(chunks[c].tapes[i]));
+                states.push_back(chunks[c].links[i].state);
+                links.push_back(chunks[c].links[i]);
+            }
+        }
+        result.configurations += links.size();
+        history.push_back(std::move(links));
+        
+        if (rejected) {
+            result.result = RunResult::REJECTED;
+        }
+        
+        if (accepted.load() < chunks_count) {
+            result.result = RunResult::ACCEPTED;
+            
+            stringstream output;
+            output << tapes.back();
+            result.output = output.str();
+            
+            size_t node = tapes.size() - 1;
+            for (size_t level = history.size(); level-- > 0;) {
+                const SearchChunk::Link& link = history[level][node];
+                result.path.push_back(link.choice);
+                result.states.push_back(link.state);
+                node = link.parent;
+            }
+            reverse(result.path.begin(), result.path.end());
+            reverse(result.states.begin(), result.states.end());
+            return result;
+        }
+    }
+    
+    return result;
+}
+
+const uint32_t Program::VERSION;
+
+//
+// Header of compiled program file
+//
+// Followed by names of the states, each as 32 bit length and characters,
+// padded to 8 bytes, halting kind of every state as single byte, padded to
+// 8 bytes, and the transition table in memory layout of Entry.
+//
+struct ProgramHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t entry_size;
+    uint32_t states_count;
+    uint32_t alphabet_size;
+    int32_t start_state;
+    uint32_t names_size;
+    uint32_t choices_count;
+    unsigned char columns[256];
+};
+
+const static char PROGRAM_MAGIC[4] = { 'T', 'M', 'C', 'P' };
+const static uint32_t PROGRAM_BYTE_ORDER = 0x01020304;
+
+static size_t padded(size_t size) {
+    return (size + 7) & ~(size_t) 7;
+}
+
+//
+// Write entries field by field so the padding is always zero
+//
+static void write_entries(ostream& out, const vector<Program::Entry>& entries) {
+    typedef Program::Entry Entry;
+    
+    vector<char> records(entries.size() * sizeof(Entry), '\0');
+    for (size_t e = 0; e < entries.size(); ++e) {
+        char* record = records.data() + e * sizeof(Entry);
+        memcpy(record + offsetof(Entry, next), &entries[e].next, sizeof(int));
+        record[offsetof(Entry, write)] = entries[e].write;
+        record[offsetof(Entry, move)] = entries[e].move;
+    }
+    out.write(records.data(), records.size());
+}
+
+//
+// Read entries and check they refer to existing states
+//
+static const char* read_entries(const char* data, size_t count, int states_count, vector<Program::Entry>& entries) {
+    entries.resize(count);
+    if (count == 0) {
+        return data;
+    }
+    memcpy(entries.data(), data, count * sizeof(Program::Entry));
+    
+    for (const auto& entry : entries) {
+        if (entry.next < TuringMachine::STUCK || entry.next >= states_count || entry.move < -1 || entry.move > 1) {
+            throw runtime_error("compiled machine: bad transition table");
+        }
+    }
+    return data + count * sizeof(Program::Entry);
+}
+
+void Program::save(ostream& out) const {
+    ProgramHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, PROGRAM_MAGIC, sizeof(header.magic));
+    header.version = VERSION;
+    header.byte_order = PROGRAM_BYTE_ORDER;
+    header.entry_size = sizeof(Entry);
+    header.states_count = (uint32_t) states_.size();
+    header.alphabet_size = (uint32_t) alphabet_size_;
+    header.start_state = start_;
+    memcpy(header.columns, columns_, sizeof(header.columns));
+    
+    string names;
+    for (const auto& state : states_) {
+        uint32_t length = (uint32_t) state.size();
+        names.append((const char*) &length, sizeof(length));
+        names.append(state);
+    }
+    header.names_size = (uint32_t) names.size();
+    names.resize(padded(names.size()), '\0');
+    
+    header.choices_count = (uint32_t) choices_.size();
+    
+    vector<char> halting(padded(states_.size()), '\0');
+    for (size_t state = 0; state < states_.size(); ++state) {
+        halting[state] = (char) halting_[state + 1];
+    }
+    
+    vector<char> offsets(padded(choice_offsets_.size() * sizeof(uint32_t)), '\0');
+    memcpy(offsets.data(), choice_offsets_.data(), choice_offsets_.size() * sizeof(uint32_t));
+    
+    out.write((const char*) &header, sizeof(header));
+    out.write(names.data(), names.size());
+    out.write(halting.data(), halting.size());
+    write_entries(out, table_);
+    out.write(offsets.data(), offsets.size());
+    write_entries(out, choices_);
+}
+
+shared_ptr<Program> Program::load(const char* data, size_t size) {
+    ProgramHeader header;
+    if (size < sizeof(header)) {
+        throw runtime_error("compiled machine: truncated header");
+    }
+    memcpy(&header, data, sizeof(header));
+    
+    if (memcmp(header.magic, PROGRAM_MAGIC, sizeof(header.magic)) != 0) {
+        throw runtime_error("compiled machine: bad magic");
+    }
+    if (header.version != VERSION || header.byte_order != PROGRAM_BYTE_ORDER || header.entry_size != sizeof(Entry)) {
+        throw runtime_error("compiled machine: unsupported version or platform");
+    }
+    if (header.states_count == 0 || header.alphabet_size == 0 || header.alphabet_size > 256) {
+        throw runtime_error("compiled machine: bad sizes");
+    }
+    
+    size_t cells = (size_t) header.states_count * header.alphabet_size;
+    size_t table_size = padded(header.states_count) + cells * sizeof(Entry) + padded((cells + 1) * sizeof(uint32_t)) + (size_t) header.choices_count * sizeof(Entry);
+    if (size - sizeof(header) < padded(header.names_size) ||
+        size - sizeof(header) - padded(header.names_size) != table_size) {
+        throw runtime_error("compiled machine: bad sizes");
+    }
+    
+    shared_ptr<Program> program(new Program());
+    program->alphabet_size_ = header.alphabet_size;
+    memcpy(program->columns_, header.columns, sizeof(header.columns));
+    
+    for (int symbol = 0; symbol < 256; ++symbol) {
+        if (program->columns_[symbol] >= header.alphabet_size) {
+            throw runtime_error("compiled machine: bad alphabet");
+        }
+    }
+    
+    const char* names = data + sizeof(header);
+    const char* names_end = names + header.names_size;
+    program->states_.reserve(header.states_count);
+    while (names < names_end) {
+        uint32_t length;
+        if ((size_t) (names_end - names) < sizeof(length)) {
+            throw runtime_error("compiled machine: bad state names");
+        }
+        memcpy(&length, names, sizeof(length));
+        names += sizeof(length);
+        
+        if ((size_t) (names_end - names) < length) {
+            throw runtime_error("compiled machine: bad state names");
+        }
+        program->states_.push_back(string(names, length));
+        names += length;
+    }
+    
+    int states_count = (int) header.states_count;
+    if (program->states_.size() != header.states_count || header.start_state < TuringMachine::STUCK || header.start_state >= states_count) {
+        throw runtime_error("compiled machine: bad state names");
+    }
+    
+    const char* halting = data + sizeof(header) + padded(header.names_size);
+    program->halting_.assign(1, Halting::STUCK);
+    for (int state = 0; state < states_count; ++state) {
+        if ((unsigned char) halting[state] > (unsigned char) Halting::REJECT) {
+            throw runtime_error("compiled machine: bad halting states");
+        }
+        program->halting_.push_back((Halting) halting[state]);
+    }
+    
+    const char* table = read_entries(halting + padded(header.states_count), cells, states_count, program->table_);
+    
+    program->choice_offsets_.resize(cells + 1);
+    memcpy(program->choice_offsets_.data(), table, (cells + 1) * sizeof(uint32_t));
+    for (size_t cell = 0; cell < cells; ++cell) {
+        if (program->choice_offsets_[cell] > program->choice_offsets_[cell + 1]) {
+            throw runtime_error("compiled machine: bad transition table");
+        }
+    }
+    if (program->choice_offsets_[0] != 0 || program->choice_offsets_[cells] != header.choices_count) {
+        throw runtime_error("compiled machine: bad transition table");
+    }
+    
+    read_entries(table + padded((cells + 1) * sizeof(uint32_t)), header.choices_count, states_count, program->choices_);
+    
+    program->start_ = header.start_state;
+    program->thread();
+    return program;
+}
+
+TrackEncoding::TrackEncoding() {
+    fill(marks_, marks_ + 256, '\0');
+    fill(unmarked_, unmarked_ + 256, '\0');
+}
+
+TrackEncoding::TrackEncoding(int tracks, const string& alphabet) : TrackEncoding() {
+    if (tracks < 1) {
+        throw runtime_error("no tracks to encode");
+    }
+    tracks_ = tracks;
+    
+    alphabet_ = string(1, Tape::EMPTY);
+    for (char symbol : alphabet) {
+        if (symbol == Tape::DELIMITER) {
+            throw runtime_error("delimiter can not be encoded as symbol of track");
+        }
+        if (alphabet_.find(symbol) == string::npos) {
+            alphabet_.push_back(symbol);
+        }
+    }
+    
+    // Marks are taken from the upper half of characters first, so they
+    // rarely stand in for printable symbols
+    vector<bool> used(256, false);
+    used[0] = used[(unsigned char) Tape::DELIMITER] = true;
+    for (char symbol : alphabet_) {
+        used[(unsigned char) symbol] = true;
+    }
+    
+    size_t character = 0x80;
+    for (char symbol : alphabet_) {
+        size_t tried = 0;
+        while (used[character] && tried++ < 256) {
+            character = (character + 1) & 0xff;
+        }
+        if (used[character]) {
+            throw runtime_error("too many symbols to encode tracks");
+        }
+        used[character] = true;
+        marks_[(unsigned char) symbol] = (char) character;
+        unmarked_[character] = symbol;
+    }
+    
+    cells_ = alphabet_;
+    for (char symbol : alphabet_) {
+        cells_.push_back(marks_[(unsigned char) symbol]);
+    }
+    cells_.push_back(Tape::DELIMITER);
+}
+
+int TrackEncoding::get_tracks_count() const {
+    return tracks_;
+}
+
+const string& TrackEncoding::get_alphabet() const {
+    return alphabet_;
+}
+
+const string& TrackEncoding::get_cells() const {
+    return cells_;
+}
+
+char TrackEncoding::mark(char symbol) const {
+    char marked = marks_[(unsigned char) symbol];
+    if (marked == '\0') {
+        throw runtime_error("symbol is not in the encoded alphabet");
+    }
+    return marked;
+}
+
+bool TrackEncoding::is_marked(char symbol) const {
+    return unmarked_[(unsigned char) symbol] != '\0';
+}
+
+char TrackEncoding::unmark(char symbol) const {
+    return is_marked(symbol) ? unmarked_[(unsigned char) symbol] : symbol;
+}
+
+Tape TrackEncoding::encode(const vector<unique_ptr<Tape>>& tapes) const {
+    if ((int) tapes.size() != tracks_) {
+        throw runtime_error("count of tapes does not match the encoding");
+    }
+    
+    string cells(1, Tape::DELIMITER);
+    for (const auto& tape : tapes) {
+        pair<long, long> bounds = tape->get_bounds();
+        long head = tape->get_position();
+        
+        // Bounds of storage may hold EMPTY cells on both ends
+        while (bounds.first <= bounds.second && tape->at(bounds.first) == Tape::EMPTY) {
+            ++bounds.first;
+        }
+        while (bounds.second >= bounds.first && tape->at(bounds.second) == Tape::EMPTY) {
+            --bounds.second;
+        }
+        if (bounds.first > bounds.second) {
+            bounds = make_pair(head, head);
+        }
+        
+        for (long position = min(bounds.first, head); position <= max(bounds.second, head); ++position) {
+            char symbol = tape->at(position);
+            if (marks_[(unsigned char) symbol] == '\0') {
+                throw runtime_error("symbol is not in the encoded alphabet");
+            }
+            cells.push_back(position == head ? mark(symbol) : symbol);
+        }
+        cells.push_back(Tape::DELIMITER);
+    }
+    
+    // Tape starting by DELIMITER would be split to tracks, so it starts
+    // one EMPTY cell earlier and the head steps over it
+    Tape tape(Tape::EMPTY + cells);
+    tape.move_right();
+    return tape;
+}
+
+vector<string> TrackEncoding::decode(const Tape& tape) const {
+    vector<string> tracks(tracks_);
+    pair<long, long> bounds = tape.get_bounds();
+    
+    int track = -1;
+    for (long position = bounds.first; position <= bounds.second && track < tracks_; ++position) {
+        char symbol = tape.at(position);
+        if (symbol == Tape::DELIMITER) {
+            ++track;
+        } else if (track >= 0 && track < tracks_ && unmark(symbol) != Tape::EMPTY) {
+            tracks[track].push_back(unmark(symbol));
+        }
+    }
+    return tracks;
+}
+
+const int TuringMachine::HALT;
+const int TuringMachine::STUCK;
+
+TuringMachine::TuringMachine() : start_state_(HALT), current_state_(HALT) {
+    intern("halt");
+    halting_[HALT] = Program::Halting::ACCEPT;
+}
+
+TuringMachine::TuringMachine(const TuringMachine &other) {
+    start_state_ = other.start_state_;
+    current_state_ = other.current_state_;
+    states_ = other.states_;
+    state_ids_ = other.state_ids_;
+    halting_ = other.halting_;
+    program_ = other.program_;
+    multi_tape_program_ = other.multi_tape_program_;
+    compiled_only_ = other.compiled_only_;
+    detect_cycles_ = other.detect_cycles_;
+    steps_ = other.steps_;
+    trace_ = other.trace_;
+    trace_out_ = other.trace_out_;
+    
+    for (const auto& e : other.tapes_) {
+        tapes_.push_back(make_unique<Tape>(*e));
+    }
+    
+    mapping_.resize(other.mapping_.size());
+    for (int state = 0; state < (int) other.mapping_.size(); ++state) {
+        for (const auto& itrans: other.mapping_[state]) {
+            mapping_[state].push_back(make_unique<Transition>(*itrans));
+        }
+    }
+}
+
+int TuringMachine::intern(const string& state) {
+    auto found = state_ids_.find(state);
+    if (found != state_ids_.end()) {
+        return found->second;
+    }
+    
+    int id = (int) states_.size();
+    states_.push_back(state);
+    state_ids_.emplace(state, id);
+    mapping_.emplace_back();
+    halting_.push_back(Program::Halting::NONE);
+    return id;
+}
+
+void TuringMachine::invalidate() {
+    program_.reset();
+    multi_tape_program_.reset();
+    index_.clear();
+    index_symbols_ = 0;
+}
+
+void TuringMachine::retarget(Transition& transition, int state) {
+    transition.change_next_state(states_[state]);
+    transition.next_id_ = state;
+    invalidate();
+}
+
+void TuringMachine::retarget(const string& state, size_t transition, const string& next_state) {
+    materialize();
+    
+    // Interning may grow the states, so the next state goes first
+    int next = intern(next_state);
+    retarget(*mapping_[intern(state)].at(transition), next);
+}
+
+void TuringMachine::materialize() {
+    if (!compiled_only_) {
+        return;
+    }
+    compiled_only_ = false;
+    
+    char symbols[256] = {};
+    for (int symbol = 0; symbol < 256; ++symbol) {
+        symbols[program_->columns_[symbol]] = (char) symbol;
+    }
+    
+    for (int state = 0; state < program_->get_states_count(); ++state) {
+        for (int column = 1; column < program_->alphabet_size_; ++column) {
+            auto choices = program_->choices(state, symbols[column]);
+            
+            for (const Program::Entry* entry = choices.first; entry != choices.second; ++entry) {
+                string command(1, entry->move > 0 ? 'R' : entry->move < 0 ? 'L' : 'S');
+                unique_ptr<Transition> transition(new Transition(states_[state], string(1, symbols[column]), string(1, entry->write), command, states_[entry->next]));
+                transition->current_id_ = state;
+                transition->next_id_ = entry->next;
+                mapping_[state].push_back(std::move(transition));
+            }
+        }
+    }
+}
+
+shared_ptr<const MultiTapeProgram> TuringMachine::compile_multi_tape() {
+    
+    // Keys are packed for the count of tapes the program was compiled for
+    if (multi_tape_program_ && multi_tape_program_->tapes_ == (int) tapes_.size()) {
+        return multi_tape_program_;
+    }
+    
+    int tapes = (int) tapes_.size();
+    if (tapes > MultiTapeProgram::MAX_TAPES) {
+        return nullptr;
+    }
+    
+    materialize();
+    shared_ptr<MultiTapeProgram> program(new MultiTapeProgram());
+    program->tapes_ = tapes;
+    program->halting_.assign(1, Program::Halting::STUCK);
+    program->halting_.insert(program->halting_.end(), halting_.begin(), halting_.end());
+    
+    size_t count = 0;
+    for (const auto& transitions : mapping_) {
+        count += transitions.size();
+    }
+    
+    size_t capacity = 16;
+    while (capacity < 2 * count) {
+        capacity *= 2;
+    }
+    program->slots_.assign(capacity, { 0, 0, -1 });
+    program->records_.reserve(count);
+    
+    for (int state = 0; state < (int) mapping_.size(); ++state) {
+        if (halting_[state] != Program::Halting::NONE) {
+            continue;
+        }
+        
+        for (const auto& transition : mapping_[state]) {
+            if (transition->get_read_symbols().size() != (size_t) tapes) {
+                return nullptr;
+            }
+            
+            MultiTapeProgram::Record record = {};
+            record.next = transition->next_id_;
+            uint64_t key = 0;
+            
+            for (int t = 0; t < tapes; ++t) {
+                key |= (uint64_t) (unsigned char) transition->get_read_symbol(t) << (8 * t);
+                
+                if (transition->get_write_symbol(t) != '\0') {
+                    record.write_mask |= 1 << t;
+                    record.write[t] = transition->get_write_symbol(t);
+                }
+                switch (transition->get_command(t)) {
+                    case 'R':
+                        record.right_mask |= 1 << t;
+                        break;
+                    case 'L':
+                        record.left_mask |= 1 << t;
+                        break;
+                }
+            }
+            
+            // The first matching transition wins as in find_transitions
+            size_t mask = capacity - 1;
+            size_t slot = slot_hash(state, key) & mask;
+            while (program->slots_[slot].record >= 0 && !(program->slots_[slot].key == key && program->slots_[slot].state == state)) {
+                slot = (slot + 1) & mask;
+            }
+            if (program->slots_[slot].record < 0) {
+                program->slots_[slot] = { key, state, (int) program->records_.size() };
+                program->records_.push_back(record);
+            }
+        }
+    }
+    
+    multi_tape_program_ = program;
+    return multi_tape_program_;
+}
+
+shared_ptr<const Program> TuringMachine::compile() {
+    if (program_) {
+        return program_;
+    }
+    
+    shared_ptr<Program> program(new Program());
+    program->states_ = states_;
+    program->start_ = start_state_;
+    program->halting_.assign(1, Program::Halting::STUCK);
+    program->halting_.insert(program->halting_.end(), halting_.begin(), halting_.end());
+    
+    for (const auto& transitions : mapping_) {
+        for (const auto& transition : transitions) {
+            if (transition->get_read_symbols().size() != 1) {
+                return nullptr;
+            }
+            
+            unsigned char symbol = transition->get_read_symbol(0);
+            if (program->columns_[symbol] == 0) {
+                program->columns_[symbol] = program->alphabet_size_++;
+            }
+        }
+    }
+    
+    size_t cells = states_.size() * program->alphabet_size_;
+    Program::Entry stuck = { STUCK, '\0', 0 };
+    program->table_.assign(cells, stuck);
+    
+    // Count transitions of every cell, then place them in order of definition
+    program->choice_offsets_.assign(cells + 1, 0);
+    for (int state = 0; state < (int) mapping_.size(); ++state) {
+        if (halting_[state] != Program::Halting::NONE) {
+            continue;
+        }
+        for (const auto& transition : mapping_[state]) {
+            ++program->choice_offsets_[state * program->alphabet_size_ + program->columns_[(unsigned char) transition->get_read_symbol(0)] + 1];
+        }
+    }
+    for (size_t cell = 0; cell < cells; ++cell) {
+        program->choice_offsets_[cell + 1] += program->choice_offsets_[cell];
+    }
+    
+    program->choices_.resize(program->choice_offsets_[cells]);
+    vector<uint32_t> placed(program->choice_offsets_.begin(), program->choice_offsets_.end() - 1);
+    
+    for (int state = 0; state < (int) mapping_.size(); ++state) {
+        if (halting_[state] != Program::Halting::NONE) {
+            continue;
+        }
+        
+        for (const auto& transition : mapping_[state]) {
+            char read = transition->get_read_symbol(0);
+            size_t cell = state * program->alphabet_size_ + program->columns_[(unsigned char) read];
+            
+            Program::Entry& entry = program->choices_[placed[cell]++];
+            entry.next = transition->next_id_;
+            entry.write = transition->get_write_symbols().empty() ? read : transition->get_write_symbol(0);
+            
+            switch (transition->get_command(0)) {
+                case 'R':
+                    entry.move = 1;
+                    break;
+                case 'L':
+                    entry.move = -1;
+                    break;
+                default:
+                    entry.move = 0;
+            }
+            
+            // The first matching transition wins as in find_transitions
+            if (program->table_[cell].next == STUCK) {
+                program->table_[cell] = entry;
+            }
+        }
+    }
+    
+    program->thread();
+    program_ = program;
+    return program_;
+}
+
+void TuringMachine::add_tape(unique_ptr<Tape> tape) {
+    tapes_.push_back(std::move(tape));
+}
+
+Tape* TuringMachine::get_tape(int index) {
+    return tapes_[index].get();
+}
+
+void TuringMachine::remove_tape(int index) {
+    tapes_.erase(tapes_.begin() + 1);
+}
+
+void TuringMachine::start_state(const string& state) {
+    materialize();
+    start_state_ = current_state_ = intern(state);
+    invalidate();
+}
+
+void TuringMachine::add_transition(unique_ptr<Transition> transition) {
+    materialize();
+    
+    transition->current_id_ = intern(transition->get_current_state());
+    transition->next_id_ = intern(transition->get_next_state());
+    
+    mapping_[transition->current_id_].push_back(std::move(transition));
+    invalidate();
+}
+
+char TuringMachine::read_symbol(int index) const {
+    return tapes_.size() == 1 ? tapes_[0]->read(index - 1) : tapes_[index]->read();
+}
+
+Transition* TuringMachine::find_transitions() {
+    
+    materialize();
+    
+    if (current_state_ == STUCK) {
+        return nullptr;
+    }
+    
+    // Symbols under heads of all tapes, or of all tracks of single tape
+    int count = tapes_.size() == 1 ? tapes_[0]->get_tracks_count() : (int) tapes_.size();
+    
+    if (count > INDEXED_SYMBOLS) {
+        for (const auto& transition : mapping_[current_state_]) {
+            bool matches = true;
+            for (int e = 0; e < count && matches; ++e) {
+                matches = transition->get_read_symbol(e) == read_symbol(e);
+            }
+            if (matches) {
+                return transition.get();
+            }
+        }
+        return nullptr;
+    }
+    
+    if (index_symbols_ != count || index_.size() != mapping_.size()) {
+        build_index(count);
+    }
+    
+    uint64_t key = 0;
+    for (int e = 0; e < count; ++e) {
+        key |= (uint64_t) (unsigned char) read_symbol(e) << (8 * e);
+    }
+    
+    const auto& index = index_[current_state_];
+    auto found = index.find(key);
+    return found == index.end() ? nullptr : found->second;
+}
+
+void TuringMachine::build_index(int count) {
+    index_.assign(mapping_.size(), unordered_map<uint64_t, Transition*>());
+    index_symbols_ = count;
+    
+    for (int state = 0; state < (int) mapping_.size(); ++state) {
+        for (const auto& transition : mapping_[state]) {
+            uint64_t key = 0;
+            for (int e = 0; e < count; ++e) {
+                key |= (uint64_t) (unsigned char) transition->get_read_symbol(e) << (8 * e);
+            }
+            
+            // The first matching transition wins
+            index_[state].emplace(key, transition.get());
+        }
+    }
+}
+
+vector<string> TuringMachine::get_states() {
+    materialize();
+    
+    vector<string> keys;
+    
+    for (int state = 0; state < (int) mapping_.size(); ++state) {
+        if (!mapping_[state].empty()) {
+            keys.push_back(states_[state]);
+        }
+    }
+    return keys;
+}
+
+const vector<unique_ptr<Transition>>& TuringMachine::get_transitions(const string& state) {
+    materialize();
+    return mapping_[intern(state)];
+}
+
+bool TuringMachine::is_finished_successfuly() const {
+    return current_state_ != STUCK && halting_[current_state_] == Program::Halting::ACCEPT;
+}
+
+vector<int> TuringMachine::get_halting_states(Program::Halting halting) const {
+    vector<int> states;
+    for (int state = 0; state < (int) halting_.size(); ++state) {
+        if (halting_[state] == halting) {
+            states.push_back(state);
+        }
+    }
+    return states;
+}
+
+void TuringMachine::set_halting_states(const vector<string>& states, Program::Halting halting) {
+    materialize();
+    
+    for (auto& kind : halting_) {
+        if (kind == halting) {
+            kind = Program::Halting::NONE;
+        }
+    }
+    for (const auto& state : states) {
+        halting_[intern(state)] = halting;
+    }
+    invalidate();
+}
+
+void TuringMachine::set_accept_states(const vector<string>& states) {
+    set_halting_states(states, Program::Halting::ACCEPT);
+}
+
+void TuringMachine::set_reject_states(const vector<string>& states) {
+    set_halting_states(states, Program::Halting::REJECT);
+}
+
+//
+// Read-only view of file content
+//
+// Maps the file to memory where possible, otherwise reads it to a buffer.
+//
+class MappedFile {
+public:
+    MappedFile(const string& filename) {
+#ifdef TM_HAS_MMAP
+        int fd = open(filename.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return;
+        }
+        
+        struct stat info;
+        if (fstat(fd, &info) == 0) {
+            open_ = true;
+            size_ = (size_t) info.st_size;
+            
+            if (size_ > 0) {
+                void* mapped = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (mapped != MAP_FAILED) {
+                    madvise(mapped, size_, MADV_SEQUENTIAL);
+                    data_ = (const char*) mapped;
+                    mapped_ = true;
+                } else {
+                    open_ = false;
+                }
+            }
+        }
+        close(fd);
+#else
+        ifstream ifs(filename, ios::in | ios::binary);
+        if (ifs.is_open()) {
+            buffer_.assign(istreambuf_iterator<char>(ifs), istreambuf_iterator<char>());
+            data_ = buffer_.data();
+            size_ = buffer_.size();
+            open_ = true;
+        }
+#endif
+    }
+    
+    ~MappedFile() {
+#ifdef TM_HAS_MMAP
+        if (mapped_) {
+            munmap((void*) data_, size_);
+        }
+#endif
+    }
+    
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    
+    bool is_open() const {
+        return open_;
+    }
+    
+    const char* data() const {
+        return data_;
+    }
+    
+    size_t size() const {
+        return size_;
+    }
+    
+private:
+    const char* data_ = "";
+    size_t size_ = 0;
+    bool open_ = false;
+    bool mapped_ = false;
+    string buffer_;
+};
+
+//
+// Single pass parser of transitions
+//
+// Walks the buffer once and returns fields of transitions
+// as pointers into the buffer, without copying them.
+//
+class TransitionParser {
+public:
     
-    for(auto const& imap: mapping_)
-        keys.push_back(imap.first);
-    return keys;
-}
+    //
+    // Symbol standing for EMPTY, which can not be written as blank
+    // since blanks separate the fields
+    //
+    const static char BLANK = '_';
+    
+    struct Field {
+        const char* data;
+        size_t length;
+        
+        string str() const {
+            return string(data, length);
+        }
+        
+        string symbols() const {
+            string symbols(data, length);
+            replace(symbols.begin(), symbols.end(), BLANK, Tape::EMPTY);
+            return symbols;
+        }
+    };
+    
+    struct Fields {
+        Field read;
+        Field old_state;
+        Field write;
+        Field new_state;
+        Field command;
+    };
+    
+    TransitionParser(const char* data, size_t length) : it_(data), end_(data + length), line_start_(data)
+    {}
+    
+    //
+    // Parse next transition
+    //
+    // Returns false when there are no more transitions.
+    //
+    bool next(Fields& fields) {
+        skip_blank_lines();
+        if (it_ == end_) {
+            return false;
+        }
+        
+        fields.read = symbols();
+        fields.old_state = state();
+        
+        skip_spaces();
+        expect('-');
+        expect('>');
+        skip_spaces();
+        
+        // Every tape is written and moved by its own symbol and command
+        const char* write = it_;
+        fields.write = symbols();
+        if (fields.write.length != fields.read.length) {
+            fail_at(write, "expected " + to_string(fields.read.length) + " write symbols");
+        }
+        fields.new_state = state();
+        
+        const char* command = it_;
+        fields.command = commands();
+        if (fields.command.length != fields.read.length) {
+            fail_at(command, "expected " + to_string(fields.read.length) + " commands");
+        }
+        return true;
+    }
+    
+private:
+    const char* it_;
+    const char* end_;
+    const char* line_start_;
+    int line_ = 1;
+    
+    bool at_line_end() const {
+        return it_ == end_ || *it_ == '\n' || *it_ == '\r';
+    }
+    
+    void skip_spaces() {
+        while (it_ != end_ && (*it_ == ' ' || *it_ == '\t')) {
+            ++it_;
+        }
+    }
+    
+    void skip_blank_lines() {
+        for (;;) {
+            skip_spaces();
+            if (it_ == end_ || (*it_ != '\n' && *it_ != '\r')) {
+                return;
+            }
+            if (*it_++ == '\n') {
+                ++line_;
+                line_start_ = it_;
+            }
+        }
+    }
+    
+    void expect(char symbol) {
+        if (at_line_end() || *it_ != symbol) {
+            fail(string("expected '") + symbol + "'");
+        }
+        ++it_;
+    }
+    
+    Field symbols() {
+        const char* start = it_;
+        while (!at_line_end() && *it_ != '{') {
+            ++it_;
+        }
+        if (start == it_) {
+            fail("expected symbols");
+        }
+        
+        // Blanks before the state separate fields like in "0 {start}"
+        const char* finish = it_;
+        while (finish[-1] == ' ' || finish[-1] == '\t') {
+            --finish;
+        }
+        return { start, (size_t) (finish - start) };
+    }
+    
+    Field state() {
+        expect('{');
+        const char* start = it_;
+        while (!at_line_end() && *it_ != '}') {
+            ++it_;
+        }
+        if (start == it_) {
+            fail("expected state name");
+        }
+        const char* finish = it_;
+        expect('}');
+        return { start, (size_t) (finish - start) };
+    }
+    
+    Field commands() {
+        const char* start = it_;
+        while (!at_line_end() && *it_ != ' ' && *it_ != '\t') {
+            if (*it_ != 'L' && *it_ != 'R' && *it_ != 'S' && *it_ != 'N') {
+                fail("expected command L, R, S or N");
+            }
+            ++it_;
+        }
+        if (start == it_) {
+            fail("expected commands");
+        }
+        const char* finish = it_;
+        
+        skip_spaces();
+        if (!at_line_end()) {
+            fail("unexpected symbols after commands");
+        }
+        return { start, (size_t) (finish - start) };
+    }
+    
+    void fail(const string& message) const {
+        fail_at(it_, message);
+    }
+    
+    void fail_at(const char* at, const string& message) const {
+        throw ParseError(message, line_, (int) (at - line_start_) + 1);
+    }
+};
+
+const char TransitionParser::BLANK;
+
+ParseError::ParseError(const string& message, int line, int column) :
+    runtime_error("line " + to_string(line) + ", column " + to_string(column) + ": " + message), line_(line), column_(column)
+{}
 
-vector<unique_ptr<Transition>>& TuringMachine::get_transitions(const string& state) {
-    return mapping_[state];
+int ParseError::get_line() const {
+    return line_;
 }
 
-bool TuringMachine::is_finished_successfuly() const {
-    return current_state_.compare("halt") == 0;
+int ParseError::get_column() const {
+    return column_;
 }
 
 TuringMachine TuringMachine::load_machine(const string &filename) {
     
+    MappedFile file(filename);
+    
+    if(!file.is_open()) {
+        return TuringMachine();
+    }
+    
+    return parse_machine(file.data(), file.size());
+}
+
+TuringMachine TuringMachine::parse_machine(const char* data, size_t length) {
+    
     TuringMachine tm;
+    TransitionParser parser(data, length);
+    TransitionParser::Fields fields;
     
-    ifstream ifs(filename, ios::in);
+    // Names are looked up through single reused buffer, so lookups
+    // do not allocate, while every transition keeps its own copies
+    string name;
     
-    if(ifs.is_open()) {
-        string line;
+    while (parser.next(fields)) {
+        name.assign(fields.old_state.data, fields.old_state.length);
+        int old_state = tm.intern(name);
         
-        // The transision format is: read_symbol{old_state} -> write_symbol{new_state}command
-        // or...                     6{increment} -> 7{decrement}L
-        regex e("[{}(\\->)]");
-        while (getline(ifs, line)){
-            string replaced = std::regex_replace(line, e, " ");
-            
-            string read_symbols, write_symbols;
-            string old_state, new_state;
-            string command;
-            
-            stringstream ss(replaced);
-            
-            ss >> read_symbols >> old_state >> write_symbols >> new_state >> command;
-            
-            tm.add_transition(unique_ptr<Transition>(new Transition(old_state, read_symbols, write_symbols, command, new_state)));
+        name.assign(fields.new_state.data, fields.new_state.length);
+        int new_state = tm.intern(name);
+        
+        unique_ptr<Transition> transition(new Transition(tm.states_[old_state], fields.read.symbols(), fields.write.symbols(), fields.command.str(), tm.states_[new_state]));
+        transition->current_id_ = old_state;
+        transition->next_id_ = new_state;
+        tm.mapping_[old_state].push_back(std::move(transition));
+    }
+    
+    return tm;
+}
+
+TuringMachine TuringMachine::parse_machine(const string& content) {
+    return parse_machine(content.data(), content.size());
+}
+
+bool TuringMachine::save_compiled(const string& filename) {
+    shared_ptr<const Program> program = compile();
+    if (!program) {
+        return false;
+    }
+    
+    ofstream ofs(filename, ios::out | ios::binary | ios::trunc);
+    if (!ofs.is_open()) {
+        return false;
+    }
+    
+    program->save(ofs);
+    ofs.close();
+    return !ofs.fail();
+}
+
+TuringMachine TuringMachine::load_compiled(const string& filename) {
+    
+    MappedFile file(filename);
+    
+    if (!file.is_open()) {
+        return TuringMachine();
+    }
+    
+    shared_ptr<Program> program = Program::load(file.data(), file.size());
+    
+    if (program->states_[HALT] != "halt") {
+        throw runtime_error("compiled machine: bad state names");
+    }
+    
+    TuringMachine tm;
+    for (int state = 1; state < program->get_states_count(); ++state) {
+        if (tm.intern(program->states_[state]) != state) {
+            throw runtime_error("compiled machine: duplicate state names");
         }
-        ifs.close();
     }
     
+    tm.halting_.assign(program->halting_.begin() + 1, program->halting_.end());
+    tm.start_state_ = tm.current_state_ = program->start_;
+    tm.program_ = program;
+    tm.compiled_only_ = true;
     return tm;
 }
 
 void TuringMachine::loop_over(const string& loop, Transition* halt) {
     
-    std::vector<int> vints;
+    materialize();
+    int loop_state = intern(loop);
     
-    for(auto const& state: get_states()) {
-        for (auto const& transition: mapping_[state]) {
-            if (transition->get_next_state().compare("halt") == 0) {
-                transition->change_next_state(loop);
+    for (auto const& transitions: mapping_) {
+        for (auto const& transition: transitions) {
+            if (halting_[transition->next_id_] == Program::Halting::ACCEPT) {
+                retarget(*transition, loop_state);
             }
         }
     }
@@ -305,24 +2662,279 @@ void TuringMachine::loop_over(const string& loop, Transition* halt) {
     add_transition(unique_ptr<Transition>(halt));
 }
 
-void TuringMachine::compose(TuringMachine another) {
-    auto another_states = another.get_states();
+vector<int> TuringMachine::join(const TuringMachine& another, const vector<int>& exits) {
+    materialize();
+    
+    // States get fresh ids after the states of this machine,
+    // names taken by this machine get the first free suffix
+    vector<int> ids(another.states_.size());
+    for (size_t state = 0; state < ids.size(); ++state) {
+        string name = another.states_[state];
+        for (int suffix = 2; state_ids_.count(name) != 0; ++suffix) {
+            name = another.states_[state] + "/" + to_string(suffix);
+        }
+        ids[state] = intern(name);
+        halting_[ids[state]] = another.halting_[state];
+    }
+    
+    vector<bool> exit(states_.size(), false);
+    for (int state : exits) {
+        exit[state] = true;
+        halting_[state] = Program::Halting::NONE;
+    }
+    
+    // Machine starting or standing in an exit goes straight to the given machine
+    int another_start = ids[another.start_state_];
+    if (exit[start_state_]) {
+        start_state_ = another_start;
+    }
+    if (current_state_ != STUCK && exit[current_state_]) {
+        current_state_ = another_start;
+    }
     
-    for(auto const& state: get_states()) {
-        for (auto const& transition: mapping_[state]) {
-            if (transition->get_next_state().compare("halt") == 0) {
-                transition->change_next_state(another.current_state_);
+    for (auto const& transitions: mapping_) {
+        for (auto const& transition: transitions) {
+            if (exit[transition->next_id_]) {
+                retarget(*transition, another_start);
             }
         }
     }
+    return ids;
+}
+
+void TuringMachine::adopt(Transition& transition, int state, const vector<int>& ids) {
+    transition.current_id_ = ids[state];
+    transition.next_id_ = ids[transition.next_id_];
+    transition.current_state_ = states_[transition.current_id_];
+    transition.next_state_ = states_[transition.next_id_];
+}
+
+void TuringMachine::compose(const TuringMachine& another) {
+    attach(another, get_halting_states(Program::Halting::ACCEPT));
+}
+
+void TuringMachine::compose(TuringMachine&& another) {
+    attach(std::move(another), get_halting_states(Program::Halting::ACCEPT));
+}
+
+void TuringMachine::attach(const TuringMachine& another, const vector<int>& exits) {
+    
+    // Joining adds states to this machine, so it can not read itself meanwhile
+    if (another.compiled_only_ || &another == this) {
+        attach(TuringMachine(another), exits);
+        return;
+    }
+    
+    vector<int> ids = join(another, exits);
+    
+    for (int state = 0; state < (int) another.mapping_.size(); ++state) {
+        for (const auto& transition : another.mapping_[state]) {
+            unique_ptr<Transition> copy(new Transition(*transition));
+            adopt(*copy, state, ids);
+            mapping_[ids[state]].push_back(std::move(copy));
+        }
+    }
+    invalidate();
+}
+
+void TuringMachine::attach(TuringMachine&& another, const vector<int>& exits) {
+    if (&another == this) {
+        attach(TuringMachine(another), exits);
+        return;
+    }
     
-    for (const auto& state : another_states) {
-        const auto& another_trans = another.get_transitions(state);
-        
-        for (const auto& trans : another_trans) {
-            mapping_[state].push_back(make_unique<Transition>(*trans));
+    another.materialize();
+    vector<int> ids = join(another, exits);
+    
+    // States of the machine are fresh and have no transitions yet,
+    // so their lists are taken whole
+    for (int state = 0; state < (int) another.mapping_.size(); ++state) {
+        auto& transitions = another.mapping_[state];
+        for (auto& transition : transitions) {
+            adopt(*transition, state, ids);
+        }
+        mapping_[ids[state]].swap(transitions);
+    }
+    another.invalidate();
+    invalidate();
+}
+
+TuringMachine TuringMachine::branch(const TuringMachine& condition, const TuringMachine& then_machine, const TuringMachine& else_machine) {
+    TuringMachine result(condition);
+    
+    // States of the branches are fresh, so only the condition leads to the exits
+    vector<int> accept = result.get_halting_states(Program::Halting::ACCEPT);
+    vector<int> reject = result.get_halting_states(Program::Halting::REJECT);
+    result.attach(then_machine, accept);
+    result.attach(else_machine, reject);
+    return result;
+}
+
+//
+// Marks of cells of the simulated tape used by to_deterministic
+//
+// Cells not changed in the current round hold the input symbol, so
+// the simulated symbol is read from the input tape. The origin of the
+// tapes is marked separately to find the way back after every round.
+//
+const static char MARK_UNTOUCHED = ' ';
+const static char MARK_TOUCHED = '+';
+const static char MARK_ORIGIN = '^';
+const static char MARK_ORIGIN_TOUCHED = '@';
+
+TuringMachine TuringMachine::to_deterministic() {
+    materialize();
+    
+    // Symbols of the simulated tape and the most choices for state and symbol
+    string symbols(1, Tape::EMPTY);
+    size_t choices = 1;
+    
+    auto add_symbol = [&symbols](char symbol) {
+        if (symbol != '\0' && symbols.find(symbol) == string::npos) {
+            symbols.push_back(symbol);
+        }
+    };
+    
+    for (const auto& transitions : mapping_) {
+        map<char, size_t> counts;
+        for (const auto& transition : transitions) {
+            if (transition->get_read_symbols().size() != 1 || transition->get_write_symbols().size() > 1) {
+                throw runtime_error("only single tape machines can be made deterministic");
+            }
+            add_symbol(transition->get_read_symbol(0));
+            add_symbol(transition->get_write_symbol(0));
+            choices = max(choices, ++counts[transition->get_read_symbol(0)]);
+        }
+    }
+    
+    if (!tapes_.empty()) {
+        stringstream input;
+        input << *tapes_[0];
+        for (char symbol : input.str()) {
+            add_symbol(symbol);
+        }
+    }
+    
+    // Choices are written as digits from '1'
+    if (choices > 126 - '0') {
+        throw runtime_error("too many choices to make machine deterministic");
+    }
+    string digits(1, Tape::EMPTY);
+    for (size_t choice = 1; choice <= choices; ++choice) {
+        digits.push_back((char) ('0' + choice));
+    }
+    string marks = { MARK_UNTOUCHED, MARK_TOUCHED, MARK_ORIGIN, MARK_ORIGIN_TOUCHED };
+    
+    TuringMachine dtm;
+    dtm.start_state("dtm/start");
+    
+    // Simulated accept state ends the search, reject state ends the round
+    auto target = [this](int state) {
+        switch (halting_[state]) {
+            case Program::Halting::ACCEPT:
+                return string("dtm/accept");
+            case Program::Halting::REJECT:
+                return string("dtm/end");
+            default:
+                return "sim/" + states_[state];
+        }
+    };
+    string start = target(start_state_);
+    
+    auto touched = [](char mark) {
+        return mark == MARK_TOUCHED || mark == MARK_ORIGIN_TOUCHED;
+    };
+    auto touch = [](char mark) {
+        return mark == MARK_ORIGIN || mark == MARK_ORIGIN_TOUCHED ? MARK_ORIGIN_TOUCHED : MARK_TOUCHED;
+    };
+    auto add = [&dtm](const string& state, const string& read, const string& write, const string& command, const string& next) {
+        dtm.add_transition(unique_ptr<Transition>(new Transition(state, read, write, command, next)));
+    };
+    
+    // Every state of the result has transition for every tuple of symbols it can read
+    for (char input : symbols) {
+        for (char simulated : symbols) {
+            for (char digit : digits) {
+                for (char mark : marks) {
+                    string read = { input, simulated, digit, mark };
+                    
+                    // Mark the origin and start with empty sequence of choices
+                    add("dtm/start", read, { input, simulated, digit, MARK_ORIGIN }, "SSSS", start);
+                    
+                    // Simulate single step following the next choice of the sequence
+                    for (int state = 0; state < (int) states_.size(); ++state) {
+                        if (halting_[state] != Program::Halting::NONE) {
+                            continue;
+                        }
+                        
+                        char symbol = touched(mark) ? simulated : input;
+                        vector<Transition*> matching;
+                        for (const auto& transition : mapping_[state]) {
+                            if (transition->get_read_symbol(0) == symbol) {
+                                matching.push_back(transition.get());
+                            }
+                        }
+                        
+                        string sim = "sim/" + states_[state];
+                        size_t choice = digit == Tape::EMPTY ? 0 : digit - '0';
+                        if (choice == 0 || choice > matching.size()) {
+                            add(sim, read, read, "SSSS", "dtm/end");
+                            continue;
+                        }
+                        
+                        const Transition& next = *matching[choice - 1];
+                        char write = next.get_write_symbols().empty() ? symbol : next.get_write_symbol(0);
+                        char command = next.get_command(0) == 'L' || next.get_command(0) == 'R' ? next.get_command(0) : 'S';
+                        string moves = { command, command, 'R', command };
+                        add(sim, read, { input, write, digit, touch(mark) }, moves, target(next.next_id_));
+                    }
+                    
+                    // End of round: mark the last cell too, so marked cells are contiguous
+                    char current = touched(mark) ? simulated : input;
+                    add("dtm/end", read, { input, current, digit, touch(mark) }, "SSSS", "dtm/left");
+                    add("dtm/accept", read, { input, current, digit, touch(mark) }, "SSSS", "dtm/copy_left");
+                    
+                    // Erase marks of the round and return to the origin
+                    if (touched(mark)) {
+                        add("dtm/left", read, read, "LLSL", "dtm/left");
+                        add("dtm/right", read, { input, simulated, digit, mark == MARK_TOUCHED ? MARK_UNTOUCHED : MARK_ORIGIN }, "RRSR", "dtm/right");
+                        add("dtm/copy_left", read, read, "LLSL", "dtm/copy_left");
+                        add("dtm/copy_right", read, { simulated, simulated, digit, MARK_UNTOUCHED }, "RRSR", "dtm/copy_right");
+                    } else {
+                        add("dtm/left", read, read, "RRSR", "dtm/right");
+                        add("dtm/right", read, read, "LLSL", "dtm/origin");
+                        add("dtm/copy_left", read, read, "RRSR", "dtm/copy_right");
+                        add("dtm/copy_right", read, read, "SSSS", "halt");
+                    }
+                    add("dtm/origin", read, read, mark == MARK_ORIGIN ? "SSSS" : "LLSL", mark == MARK_ORIGIN ? "dtm/seek" : "dtm/origin");
+                    
+                    // Go to the next sequence of choices in order of length
+                    if (digit == Tape::EMPTY) {
+                        add("dtm/seek", read, read, "SSLS", "dtm/increment");
+                        add("dtm/increment", read, { input, simulated, '1', mark }, "SSSS", "dtm/rewind");
+                        add("dtm/rewind", read, read, "SSRS", start);
+                    } else {
+                        add("dtm/seek", read, read, "SSRS", "dtm/seek");
+                        if (digit == digits.back()) {
+                            add("dtm/increment", read, { input, simulated, '1', mark }, "SSLS", "dtm/increment");
+                        } else {
+                            add("dtm/increment", read, { input, simulated, (char) (digit + 1), mark }, "SSSS", "dtm/rewind");
+                        }
+                        add("dtm/rewind", read, read, "SSLS", "dtm/rewind");
+                    }
+                }
+            }
+        }
+    }
+    
+    if (!tapes_.empty()) {
+        dtm.add_tape(make_unique<Tape>(*tapes_[0]));
+        for (int t = 0; t < 3; ++t) {
+            dtm.add_tape(make_unique<Tape>(""));
         }
     }
+    
+    return dtm;
 }
 
 void TuringMachine::to_single_tape() {
@@ -330,29 +2942,290 @@ void TuringMachine::to_single_tape() {
         return;
     }
     
-    stringstream ss("", ios_base::app | ios_base::out);
+    // Other tapes become tracks of the first one with their heads
+    for (size_t t = 1; t < tapes_.size(); ++t) {
+        tapes_[0]->append_tracks(std::move(*tapes_[t]));
+    }
+    tapes_.resize(1);
+}
+
+TuringMachine TuringMachine::to_single_tape_machine(TrackEncoding* encoding) {
+    materialize();
+    
+    int tracks = (int) tapes_.size();
+    string symbols(1, Tape::EMPTY);
+    
+    // Transitions of every state follow each other from its offset
+    vector<const Transition*> transitions;
+    vector<size_t> offsets;
+    
+    auto add_symbol = [&symbols](char symbol) {
+        if (symbol != '\0' && symbols.find(symbol) == string::npos) {
+            symbols.push_back(symbol);
+        }
+    };
+    
+    for (const auto& state_transitions : mapping_) {
+        offsets.push_back(transitions.size());
+        for (const auto& transition : state_transitions) {
+            if (tracks == 0) {
+                tracks = (int) transition->get_read_symbols().size();
+            }
+            if ((int) transition->get_read_symbols().size() != tracks) {
+                throw runtime_error("transitions must read symbol of every tape");
+            }
+            for (int t = 0; t < tracks; ++t) {
+                add_symbol(transition->get_read_symbol(t));
+                add_symbol(transition->get_write_symbol(t));
+            }
+            transitions.push_back(transition.get());
+        }
+    }
+    offsets.push_back(transitions.size());
+    
+    for (const auto& tape : tapes_) {
+        stringstream content;
+        content << *tape;
+        for (char symbol : content.str()) {
+            add_symbol(symbol);
+        }
+    }
+    
+    TrackEncoding codes(max(tracks, 1), symbols);
+    tracks = codes.get_tracks_count();
+    
+    //
+    // Control state of the simulation
+    //
+    // GATHER sweeps right collecting marked symbols of the tracks for the state,
+    // SEEK sweeps left over given count of DELIMITERs to the mark of the track.
+    // RIGHT and LEFT mark the cell the head of the track moved to, and SHIFT
+    // moves the rest of the tape right by one cell when the head left the track.
+    //
+    enum Kind { GATHER, SEEK, RIGHT, LEFT, SHIFT };
+    struct Control {
+        Kind kind;
+        int id;
+        string seen;
+        int track;
+        int delimiters;
+        char carry;
+    };
+    
+    auto name = [this](const Control& control) {
+        stringstream out;
+        switch (control.kind) {
+            case GATHER:
+                out << "gather/" << states_[control.id] << '/';
+                for (size_t t = 0; t < control.seen.size(); ++t) {
+                    out << (t > 0 ? "," : "") << (int) (unsigned char) control.seen[t];
+                }
+                break;
+            case SEEK:
+                out << "seek/" << control.id << '/' << control.track << '/' << control.delimiters;
+                break;
+            case RIGHT:
+                out << "right/" << control.id << '/' << control.track;
+                break;
+            case LEFT:
+                out << "left/" << control.id << '/' << control.track;
+                break;
+            case SHIFT:
+                out << "shift/" << control.id << '/' << control.track << '/' << (int) (unsigned char) control.carry << '/' << control.delimiters;
+                break;
+        }
+        return out.str();
+    };
+    
+    TuringMachine single;
+    deque<Control> pending;
+    unordered_map<string, bool> named;
+    
+    // Name of the state, queued for expansion when seen first time
+    auto next = [&](const Control& control) {
+        string state = name(control);
+        if (named.emplace(state, true).second) {
+            pending.push_back(control);
+        }
+        return state;
+    };
+    auto gather = [&](int state) {
+        switch (halting_[state]) {
+            case Program::Halting::ACCEPT:
+                return string("halt");
+            case Program::Halting::REJECT:
+                return string("reject");
+            default:
+                return next({ GATHER, state, "", 0, 0, '\0' });
+        }
+    };
+    auto add = [&single](const string& state, char read, char write, const string& command, const string& next_state) {
+        single.add_transition(unique_ptr<Transition>(new Transition(state, string(1, read), string(1, write), command, next_state)));
+    };
+    
+    // Apply transition to the track whose marked cell is under the head,
+    // then continue by the track on the left
+    auto apply = [&](const string& state, char cell, int id, int track) {
+        const Transition& transition = *transitions[id];
+        char write = transition.get_write_symbol(track);
+        if (write == '\0') {
+            write = codes.unmark(cell);
+        }
+        
+        switch (transition.get_command(track)) {
+            case 'R':
+                add(state, cell, write, "R", next({ RIGHT, id, "", track, 0, '\0' }));
+                break;
+            case 'L':
+                add(state, cell, write, "L", next({ LEFT, id, "", track, 0, '\0' }));
+                break;
+            default:
+                add(state, cell, codes.mark(write), "L", next({ SEEK, id, "", track - 1, 1, '\0' }));
+                break;
+        }
+    };
+    
+    single.set_reject_states({ "reject" });
+    single.start_state(gather(start_state_));
+    
+    while (!pending.empty()) {
+        Control control = pending.front();
+        pending.pop_front();
+        string state = name(control);
+        
+        for (char cell : codes.get_cells()) {
+            switch (control.kind) {
+                case GATHER: {
+                    if (!codes.is_marked(cell)) {
+                        add(state, cell, cell, "R", state);
+                        break;
+                    }
+                    
+                    string seen = control.seen + codes.unmark(cell);
+                    if ((int) seen.size() < tracks) {
+                        add(state, cell, cell, "R", next({ GATHER, control.id, seen, 0, 0, '\0' }));
+                        break;
+                    }
+                    
+                    // All symbols are known, the first matching transition wins
+                    for (size_t e = offsets[control.id]; e < offsets[control.id + 1]; ++e) {
+                        if (transitions[e]->get_read_symbols() == seen) {
+                            apply(state, cell, (int) e, tracks - 1);
+                            break;
+                        }
+                    }
+                    break;
+                }
+                case SEEK: {
+                    if (cell == Tape::DELIMITER) {
+                        if (control.delimiters > 1) {
+                            add(state, cell, cell, "L", next({ SEEK, control.id, "", control.track, control.delimiters - 1, '\0' }));
+                        } else if (control.delimiters == 1 && control.track >= 0) {
+                            add(state, cell, cell, "L", next({ SEEK, control.id, "", control.track, 0, '\0' }));
+                        } else if (control.delimiters == 1) {
+                            add(state, cell, cell, "R", gather(transitions[control.id]->next_id_));
+                        }
+                    } else if (control.delimiters == 0 && codes.is_marked(cell)) {
+                        apply(state, cell, control.id, control.track);
+                    } else {
+                        add(state, cell, cell, "L", state);
+                    }
+                    break;
+                }
+                case RIGHT:
+                    if (codes.is_marked(cell)) {
+                        break;
+                    }
+                    if (cell == Tape::DELIMITER) {
+                        add(state, cell, codes.mark(Tape::EMPTY), "R", next({ SHIFT, control.id, "", control.track, tracks - 1 - control.track, Tape::DELIMITER }));
+                    } else {
+                        add(state, cell, codes.mark(cell), "L", next({ SEEK, control.id, "", control.track - 1, 1, '\0' }));
+                    }
+                    break;
+                case LEFT:
+                    if (codes.is_marked(cell)) {
+                        break;
+                    }
+                    if (cell == Tape::DELIMITER) {
+                        add(state, cell, cell, "R", next({ SHIFT, control.id, "", control.track, tracks - control.track, codes.mark(Tape::EMPTY) }));
+                    } else {
+                        add(state, cell, codes.mark(cell), "L", next({ SEEK, control.id, "", control.track - 1, 1, '\0' }));
+                    }
+                    break;
+                case SHIFT:
+                    if (control.delimiters > 0) {
+                        add(state, cell, control.carry, "R", next({ SHIFT, control.id, "", control.track, control.delimiters - (cell == Tape::DELIMITER), cell }));
+                    } else if (cell == Tape::EMPTY) {
+                        // The last DELIMITER is carried past the end, back to the track on the left
+                        add(state, cell, control.carry, "L", next({ SEEK, control.id, "", control.track - 1, tracks - control.track, '\0' }));
+                    }
+                    break;
+            }
+        }
+    }
     
-    for (const auto &tape : tapes_) {
-        ss << '#';
-        ss << *tape;
+    if (!tapes_.empty()) {
+        single.add_tape(make_unique<Tape>(codes.encode(tapes_)));
+    }
+    if (encoding != nullptr) {
+        *encoding = codes;
     }
     
-    tapes_.erase(tapes_.begin(), tapes_.end());
-    Tape* tape = new Tape(ss.str());
-    add_tape(make_unique<Tape>(*tape));
+    return single;
+}
+
+void TuringMachine::set_cycle_detection(bool detect) {
+    detect_cycles_ = detect;
+}
+
+void TuringMachine::set_trace(Trace trace, ostream& out) {
+    flush_trace();
+    trace_ = trace;
+    trace_out_ = &out;
+}
+
+void TuringMachine::trace(Transition& transition) {
+    switch (trace_) {
+        case Trace::OFF:
+            break;
+        case Trace::BUFFERED:
+            trace_buffer_ << transition << '\n';
+            if (trace_buffer_.tellp() >= (1 << 16)) {
+                flush_trace();
+            }
+            break;
+        case Trace::FULL:
+            *trace_out_ << transition << endl;
+            break;
+    }
+}
+
+void TuringMachine::flush_trace() {
+    if (trace_buffer_.tellp() > 0) {
+        *trace_out_ << trace_buffer_.rdbuf();
+        trace_out_->flush();
+        trace_buffer_.str("");
+    }
 }
 
 void TuringMachine::step() {
+    advance();
+    flush_trace();
+}
+
+void TuringMachine::advance() {
     
-    Transition *next = find_transitions(tapes_[0]->read());
+    Transition *next = find_transitions();
     
     if (nullptr == next) {
-        current_state_ = "";
+        current_state_ = STUCK;
         return;
     }
     
-    cout << *next << endl;
-    current_state_ = next->get_next_state();
+    if (trace_ != Trace::OFF) {
+        trace(*next);
+    }
+    current_state_ = next->next_id_;
     
     if (tapes_.size() == 1) {
         for (int r = 0, t = -1; r < next->get_read_symbols().size(); ++t, ++r) {
@@ -372,7 +3245,7 @@ void TuringMachine::step() {
         return;
     }
     
-    for (int t = 0; t < tapes_.size(); ++t) {
+    for (int t = 0; t < (int) tapes_.size(); ++t) {
         if (tapes_[t]->read() == next->get_read_symbol(t) && next->get_write_symbol(t) != '\0') {
             tapes_[t]->write(next->get_write_symbol(t));
         }
@@ -388,10 +3261,93 @@ void TuringMachine::step() {
     }
 }
 
-void TuringMachine::run() {
-    while(current_state_ != "" && current_state_ != "halt") {
-        step();
+RunResult TuringMachine::run() {
+    return run(UINT64_MAX, chrono::steady_clock::time_point::max());
+}
+
+RunResult TuringMachine::run(uint64_t max_steps) {
+    return run(max_steps, chrono::steady_clock::time_point::max());
+}
+
+RunResult TuringMachine::run(uint64_t max_steps, chrono::steady_clock::time_point deadline) {
+    shared_ptr<const Program> program;
+    if (trace_ == Trace::OFF && tapes_.size() == 1 && tapes_[0]->get_tracks_count() == 1) {
+        program = compile();
+    }
+    
+    Program::Options options;
+    options.max_steps = max_steps;
+    options.deadline = deadline;
+    options.detect_cycles = detect_cycles_;
+    
+    if (program) {
+        return program->run(*tapes_[0], current_state_, steps_, options);
+    }
+    
+    shared_ptr<const MultiTapeProgram> multi_tape_program;
+    if (trace_ == Trace::OFF && tapes_.size() > 1) {
+        multi_tape_program = compile_multi_tape();
+        for (const auto& tape : tapes_) {
+            if (tape->get_tracks_count() != 1) {
+                multi_tape_program.reset();
+            }
+        }
+    }
+    
+    if (multi_tape_program) {
+        return multi_tape_program->run(tapes_, current_state_, steps_, options);
+    }
+    
+    bool timed = deadline != chrono::steady_clock::time_point::max();
+    RunResult result = RunResult::STUCK;
+    steps_ = 0;
+    
+    while (current_state_ != STUCK && halting_[current_state_] == Program::Halting::NONE) {
+        if (steps_ >= max_steps) {
+            result = RunResult::STEP_LIMIT;
+            break;
+        }
+        if (timed && steps_ % DEADLINE_INTERVAL == 0 && chrono::steady_clock::now() >= deadline) {
+            result = RunResult::TIMEOUT;
+            break;
+        }
+        advance();
+        if (current_state_ != STUCK) {
+            ++steps_;
+        }
+    }
+    flush_trace();
+    
+    if (current_state_ != STUCK && halting_[current_state_] != Program::Halting::NONE) {
+        result = halting_result(halting_[current_state_]);
+    }
+    return result;
+}
+
+uint64_t TuringMachine::get_steps() const {
+    return steps_;
+}
+
+SearchResult TuringMachine::run_nondeterministic(const Program::Options& options, unsigned threads) {
+    shared_ptr<const Program> program = compile();
+    if (!program) {
+        throw runtime_error("machine can not be compiled");
+    }
+    
+    // Machine without tape searches from empty one
+    Tape empty("");
+    return NondeterministicRunner(program, threads).run(tapes_.empty() ? empty : *tapes_[0], current_state_, options);
+}
+
+vector<BatchResult> TuringMachine::run_batch(const vector<string>& inputs, unsigned threads) {
+    shared_ptr<const Program> program = compile();
+    if (!program) {
+        throw runtime_error("machine can not be compiled");
     }
+    
+    Program::Options options;
+    options.detect_cycles = detect_cycles_;
+    return BatchRunner(program, threads).run(inputs, options);
 }
 
 void TuringMachine::print() {
@@ -10,14 +10,23 @@
 #define tm_hpp
 
 #include <vector>
+#include <deque>
 #include <string>
 #include <map>
+#include <unordered_map>
+#include <memory>
 #include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <cstdint>
+#include <chrono>
 
 using namespace std;
 
 class Tape;
+class TapeStorage;
 class Transition;
+class Program;
 
 //
 // Tape class
@@ -26,14 +35,31 @@ class Transition;
 // Tapes represent potencial endless buffer of symbols and head which can
 // read/write symbols and navigate through tape.
 //
+// Symbols are kept by one of the storages selected when the tape is created:
+//
+// PAGED keeps fixed size pages addressed by signed head position.
+// Moving the head is an increment of offset in the current page, and the tape
+// grows in both directions by whole pages filled with EMPTY symbols.
+//
+// RUN_LENGTH keeps runs of equal symbols as (symbol, count) pairs, so tapes
+// with billions of cells but only few runs take just a few bytes.
+//
 class Tape {
 public:
     
     const static char EMPTY = ' ';
     const static char DELIMITER = '#';
+    const static int PAGE_SIZE = 4096;
+    
+    enum class Storage { PAGED, RUN_LENGTH };
     
-    Tape(const string &);
+    Tape(const string &, Storage = Storage::PAGED);
     Tape(const Tape&);
+    Tape(Tape&&);
+    ~Tape();
+    
+    Tape& operator=(const Tape&);
+    Tape& operator=(Tape&&);
     
     //
     // Move the tape head to right
@@ -87,18 +113,79 @@ public:
     //
     void write(char, int = -1);
     
+    //
+    // Get count of tracks of the tape
+    //
+    // Single tape has one track, tape result of converting
+    // multiple tape machine has one track per virtual tape more.
+    //
+    int get_tracks_count() const;
+    
+    //
+    // Get kind of storage used by the tape
+    //
+    Storage get_storage() const;
+    
+    //
+    // Add tape as the next track of this tape
+    //
+    // Storage of the tape is moved with its head, tracks of the added
+    // tape follow it. Nothing is copied.
+    //
+    void append_tracks(Tape&&);
+    
+    //
+    // Enable or disable hashing of the tape
+    //
+    // While enabled, every write updates Zobrist style hash of the content,
+    // so hash of the whole tape is available in constant time.
+    // Hashing is disabled by default and then writes do not pay for it.
+    //
+    void set_hashing(bool);
+    
+    //
+    // Get hash of content and head position of the tape
+    //
+    // Hashing must be enabled. Tapes with equal content and head positions
+    // always have equal hash, no matter how they got there.
+    //
+    uint64_t get_hash() const;
+    
+    //
+    // Get signed position of the head
+    //
+    // The first symbol of the input is at position 0.
+    //
+    long get_position() const;
+    
+    //
+    // Read symbol at any position without moving the head
+    //
+    // Run-length tapes remember the last looked up cell,
+    // so the same tape must not be read from several threads.
+    //
+    char at(long) const;
+    
+    //
+    // Get first and last position of cells kept by the tape
+    //
+    // Cells out of the bounds are EMPTY.
+    //
+    pair<long, long> get_bounds() const;
+    
     friend ostream& operator<<(ostream&, Tape&);
 private:
     vector<Tape> virtual_tapes_;
-    vector<char> left_;
-    vector<char> right_;
-    char current_ = '\0';
+    unique_ptr<TapeStorage> storage_;
     
     //
     // Helper fuction which initialize tape
     // with given input string.
     //
-    void initialize(const string&);
+    void initialize(const string&, Storage);
+    
+    friend class Program;
+    friend class MultiTapeProgram;
 };
 
 
@@ -130,6 +217,23 @@ private:
     string current_state_;
     string next_state_;
     
+    //
+    // Interned ids of current and next state
+    //
+    // Set by the machine when the transition is added to it,
+    // so stepping never has to compare state names.
+    //
+    int current_id_ = -1;
+    int next_id_ = -1;
+    
+    //
+    // Change next state of transition
+    //
+    // Only the machine changes it, keeping the name and id together.
+    //
+    void change_next_state(const string&);
+    
+    friend class TuringMachine;
 public:
     Transition(const string& current_state, const string&, const string&, const string&, const string& next_state);
     Transition(const Transition&);
@@ -183,12 +287,551 @@ public:
     //
     string get_current_state() const;
     
+    friend ostream& operator<<(ostream&, Transition&);
+};
+
+//
+// Parse error class
+//
+// Thrown when machine description does not follow the transition syntax.
+// Lines and columns are counted from 1.
+//
+class ParseError : public runtime_error {
+private:
+    int line_;
+    int column_;
+    
+public:
+    ParseError(const string&, int line, int column);
+    
+    int get_line() const;
+    int get_column() const;
+};
+
+//
+// Result of running machine
+//
+// ACCEPTED or REJECTED when the machine reached accept or reject state,
+// STUCK when there was no transition for the current state and symbol,
+// LOOPING when the machine repeated configuration and so will never stop.
+// STEP_LIMIT and TIMEOUT when the machine was stopped by the step budget
+// or deadline of the run.
+//
+enum class RunResult { ACCEPTED, REJECTED, STUCK, LOOPING, STEP_LIMIT, TIMEOUT };
+
+//
+// Program class
+//
+// Compiled form of single tape machine. States and read symbols are
+// flattened into contiguous table indexed by state * alphabet size + symbol,
+// so every step of the machine is single indexed load instead of
+// searching the state transitions.
+//
+// Programs are built once by the machine and never change after that,
+// so single program may be shared by any number of executions.
+//
+class Program {
+public:
+    
     //
-    // Change next state of transition
+    // Packed transition record
     //
-    void change_next_state(const string&);
+    // Next state is STUCK when there is no transition for the state and symbol.
+    // Move is -1 for left, 1 for right and 0 for no move.
+    //
+    struct Entry {
+        int next;
+        char write;
+        signed char move;
+    };
     
-    friend ostream& operator<<(ostream&, Transition&);
+    //
+    // Limits and checks of single run
+    //
+    // The deadline is checked only once per many thousands of steps,
+    // so the run may stop slightly after it.
+    //
+    // Nondeterministic runs take the steps as depth of the search
+    // and stop also after creating given count of configurations.
+    //
+    struct Options {
+        uint64_t max_steps;
+        uint64_t max_configurations;
+        chrono::steady_clock::time_point deadline;
+        bool detect_cycles;
+        
+        Options() : max_steps(UINT64_MAX), max_configurations(UINT64_MAX), deadline(chrono::steady_clock::time_point::max()), detect_cycles(false) {}
+    };
+    
+    //
+    // Halting kind of state
+    //
+    // Machine stops in ACCEPT and REJECT states and runs on from NONE ones.
+    // STUCK is kind of TuringMachine::STUCK, which is not a real state.
+    //
+    enum class Halting : unsigned char { NONE, ACCEPT, REJECT, STUCK };
+    
+    //
+    // Get halting kind of state
+    //
+    Halting get_halting(int state) const {
+        return halting_[state + 1];
+    }
+    
+    //
+    // Operation of threaded code
+    //
+    // STOP ends the run, in halting state or where there is no transition.
+    // SWEEP operations are self loops moving in one direction.
+    //
+    enum class Operation : unsigned char { STOP, STAY, LEFT, RIGHT, SWEEP_LEFT, SWEEP_RIGHT };
+    
+    //
+    // Instruction of threaded code
+    //
+    // Every entry of the transition table has instruction with operation
+    // decided when the program is built, so running never branches on move
+    // or halting kind of the next state.
+    //
+    struct Instruction {
+        int next;
+        char write;
+        Operation operation;
+    };
+    
+    //
+    // Get transition record for state and read symbol
+    //
+    const Entry& lookup(int state, char symbol) const {
+        return table_[state * alphabet_size_ + columns_[(unsigned char) symbol]];
+    }
+    
+    //
+    // Get instruction for state and read symbol
+    //
+    const Instruction& fetch(int state, char symbol) const {
+        return code_[state * alphabet_size_ + columns_[(unsigned char) symbol]];
+    }
+    
+    //
+    // Get all transition records for state and read symbol
+    //
+    // Records are in order of definition of the transitions.
+    // Deterministic runs take only the first of them.
+    //
+    pair<const Entry*, const Entry*> choices(int state, char symbol) const {
+        size_t cell = state * alphabet_size_ + columns_[(unsigned char) symbol];
+        return { choices_.data() + choice_offsets_[cell], choices_.data() + choice_offsets_[cell + 1] };
+    }
+    
+    //
+    // Get count of states of the program
+    //
+    int get_states_count() const;
+    
+    //
+    // Get name of state by its id
+    //
+    const string& get_state_name(int) const;
+    
+    //
+    // Get symbols which have transitions in the program
+    //
+    string get_alphabet() const;
+    
+    //
+    // Get id of the state where executions of the program start
+    //
+    int get_start_state() const;
+    
+    //
+    // Run the program on given tape from given state
+    //
+    // The state is updated to the state where the program stopped
+    // and the steps to count of executed steps. If cycle detection
+    // is enabled, running stops as soon as configuration of the machine repeats.
+    //
+    RunResult run(Tape&, int&, uint64_t&, const Options& = Options()) const;
+    
+    //
+    // Write program in binary format
+    //
+    // The format is versioned header with columns of the alphabet,
+    // table of state names, start state, halting kinds of the states
+    // and the packed transition table.
+    //
+    void save(ostream&) const;
+    
+    //
+    // Read program written by save from memory buffer
+    //
+    // The transition table is copied from the buffer at once.
+    // Throws runtime_error if the buffer is not program of this version.
+    //
+    static shared_ptr<Program> load(const char*, size_t);
+    
+    const static uint32_t VERSION = 3;
+    
+private:
+    vector<string> states_;
+    
+    //
+    // Halting kind of every state, shifted by one so STUCK has kind too
+    //
+    vector<Halting> halting_;
+    vector<Entry> table_;
+    int alphabet_size_ = 1;
+    int start_ = 0;
+    
+    //
+    // All transitions of every state and symbol
+    //
+    // Records of cell of the table are choices_ from choice_offsets_[cell]
+    // to choice_offsets_[cell + 1].
+    //
+    vector<uint32_t> choice_offsets_;
+    vector<Entry> choices_;
+    
+    //
+    // Threaded code, instruction for every entry of the table
+    //
+    vector<Instruction> code_;
+    
+    //
+    // Build threaded code from the table and halting kinds of the states
+    //
+    void thread();
+    
+    //
+    // Column of each symbol in the table
+    //
+    // Column 0 is shared by all symbols without transitions.
+    //
+    unsigned char columns_[256] = {};
+    
+    friend class TuringMachine;
+};
+
+//
+// Multiple tape program class
+//
+// Compiled form of machine with up to MAX_TAPES tapes. Symbols under all
+// heads are packed to single 64 bit key, one byte per tape, and transitions
+// are found by state and the key in open addressing hash table. Running
+// keeps the key up to date after every write and move, so every step is
+// single lookup no matter the count of tapes.
+//
+class MultiTapeProgram {
+public:
+    
+    const static int MAX_TAPES = 8;
+    
+    //
+    // Packed transition record
+    //
+    // Bit t of the masks is set if tape t is written, moved left or right.
+    //
+    struct Record {
+        int next;
+        uint8_t write_mask;
+        uint8_t left_mask;
+        uint8_t right_mask;
+        char write[MAX_TAPES];
+    };
+    
+    //
+    // Get count of tapes of the program
+    //
+    int get_tapes_count() const;
+    
+    //
+    // Get transition record for state and packed read symbols
+    //
+    // Returns nullptr if there is no transition.
+    //
+    const Record* lookup(int, uint64_t) const;
+    
+    //
+    // Get halting kind of state
+    //
+    Program::Halting get_halting(int state) const {
+        return halting_[state + 1];
+    }
+    
+    //
+    // Run the program on given tapes from given state
+    //
+    // Works as Program::run, except that cycles are not detected.
+    // Tapes of the same storage kind are run without virtual calls.
+    //
+    RunResult run(const vector<unique_ptr<Tape>>&, int&, uint64_t&, const Program::Options& = Program::Options()) const;
+    
+private:
+    struct Slot {
+        uint64_t key;
+        int state;
+        int record;
+    };
+    
+    int tapes_ = 0;
+    vector<Record> records_;
+    vector<Program::Halting> halting_;
+    
+    //
+    // Hash table of the records, capacity is power of two
+    // and empty slots have record -1
+    //
+    vector<Slot> slots_;
+    
+    friend class TuringMachine;
+};
+
+//
+// Execution class
+//
+// Run state of single program: the tape, current state and count of
+// executed steps. Executions are cheap to create and share the program,
+// so the same machine can be run many times, also from many threads,
+// without copying its transitions.
+//
+class Execution {
+public:
+    
+    //
+    // Create execution of the program on given input
+    //
+    Execution(shared_ptr<const Program>, const string& = "", Tape::Storage = Tape::Storage::PAGED);
+    
+    //
+    // Get the program of the execution
+    //
+    const Program& get_program() const;
+    
+    //
+    // Get tape of the execution
+    //
+    Tape& get_tape();
+    
+    //
+    // Get id of current state
+    //
+    int get_state() const;
+    
+    //
+    // Get count of executed steps
+    //
+    uint64_t get_steps() const;
+    
+    //
+    // Check if the execution reached halt state
+    //
+    bool is_finished_successfuly() const;
+    
+    //
+    // Execute single step
+    //
+    // Returns false if the execution is already halted or stuck.
+    //
+    bool step();
+    
+    //
+    // Run the execution until it stops or reaches limits
+    //
+    RunResult run(const Program::Options& = Program::Options());
+    
+private:
+    shared_ptr<const Program> program_;
+    Tape tape_;
+    int state_;
+    uint64_t steps_ = 0;
+};
+
+//
+// Result of running program on single input of a batch
+//
+struct BatchResult {
+    RunResult result;
+    uint64_t steps;
+    string output;
+};
+
+//
+// Batch runner class
+//
+// Runs one program against many inputs on a pool of threads.
+// The program is shared by all workers, each input gets its own tape.
+// Inputs are dealt to workers in contiguous blocks and a worker which
+// runs out of inputs steals from the back of another worker's block,
+// so long running inputs do not leave the other threads idle.
+//
+class BatchRunner {
+public:
+    
+    //
+    // Create runner of given program
+    //
+    // Count of threads 0 means one thread per hardware thread.
+    //
+    BatchRunner(shared_ptr<const Program>, unsigned = 0);
+    
+    //
+    // Set storage of the tapes created for inputs
+    //
+    void set_storage(Tape::Storage);
+    
+    //
+    // Run the program on all inputs
+    //
+    // Results are returned in order of the inputs. Output of every run
+    // is the content of its tape.
+    //
+    vector<BatchResult> run(const vector<string>&, const Program::Options& = Program::Options()) const;
+    
+private:
+    shared_ptr<const Program> program_;
+    unsigned threads_;
+    Tape::Storage storage_ = Tape::Storage::PAGED;
+};
+
+//
+// Result of nondeterministic run
+//
+// The path holds index of the chosen transition among transitions matching
+// the state and symbol for every step, the states hold state after every step.
+// Output is the tape of the accepting configuration.
+//
+struct SearchResult {
+    RunResult result;
+    vector<int> path;
+    vector<int> states;
+    string output;
+    uint64_t configurations;
+};
+
+//
+// Nondeterministic runner class
+//
+// Follows all transitions matching the state and read symbol and searches
+// the tree of configurations breadth first for a path to halt state.
+// Every level of the tree is split to chunks which worker threads take from
+// shared counter. Children of every chunk are kept apart, so the next level
+// is in the same order as in sequential search and the first accepting
+// path does not depend on count of threads.
+//
+// Every configuration has its own copy of the tape, so run length encoded
+// tapes are much cheaper to search than paged ones.
+//
+class NondeterministicRunner {
+public:
+    
+    //
+    // Create runner of given program
+    //
+    // Count of threads 0 means one thread per hardware thread.
+    //
+    NondeterministicRunner(shared_ptr<const Program>, unsigned = 0);
+    
+    //
+    // Enable or disable pruning of repeated configurations
+    //
+    // Configurations are compared by 64 bit hash of state, head position
+    // and tape, kept in visited set shared by the workers. Only the first
+    // configuration in order of sequential search is kept, so the result
+    // still does not depend on count of threads. Enabled by default.
+    //
+    void set_deduplication(bool);
+    
+    //
+    // Search from given tape and state
+    //
+    // Returns ACCEPTED with the first path to accept state. Paths are not
+    // followed from reject states, REJECTED is returned when no path accepts
+    // and some reached reject state, STUCK when all got stuck.
+    // STEP_LIMIT or TIMEOUT when limits are reached.
+    //
+    SearchResult run(const Tape&, int, const Program::Options& = Program::Options()) const;
+    
+    //
+    // Search from start state of the program with given input on run length encoded tape
+    //
+    SearchResult run(const string&, const Program::Options& = Program::Options()) const;
+    
+private:
+    shared_ptr<const Program> program_;
+    unsigned threads_;
+    bool deduplication_ = true;
+};
+
+//
+// Track encoding class
+//
+// Layout of multiple tapes on single tape simulating them. Tracks lie one
+// after another between DELIMITERs, as tracks of tape converted by
+// to_single_tape() are printed, and the symbol under the head of every
+// track is replaced by its marked counterpart. Marked symbols are the
+// characters not used by the tracks, so the alphabet does not grow with
+// count of tracks, it only can not have more than 126 symbols besides EMPTY.
+//
+class TrackEncoding {
+public:
+    TrackEncoding();
+    
+    //
+    // Create encoding of given count of tracks over given symbols
+    //
+    // Throws runtime_error if the symbols with their marked counterparts
+    // do not fit in a character or DELIMITER is one of the symbols.
+    //
+    TrackEncoding(int, const string&);
+    
+    int get_tracks_count() const;
+    const string& get_alphabet() const;
+    
+    //
+    // Get all symbols of the single tape
+    //
+    // Symbols of the tracks, their marked counterparts and DELIMITER.
+    //
+    const string& get_cells() const;
+    
+    //
+    // Get symbol marked by head
+    //
+    char mark(char) const;
+    
+    //
+    // Return true if symbol is marked by head
+    //
+    bool is_marked(char) const;
+    
+    //
+    // Get symbol without mark of head
+    //
+    char unmark(char) const;
+    
+    //
+    // Encode tapes to single tape
+    //
+    // The head of the result is on the DELIMITER left of the first track.
+    //
+    Tape encode(const vector<unique_ptr<Tape>>&) const;
+    
+    //
+    // Decode single tape to non EMPTY symbols of every track
+    //
+    vector<string> decode(const Tape&) const;
+    
+private:
+    int tracks_ = 0;
+    string alphabet_;
+    string cells_;
+    
+    //
+    // Marked counterpart of every symbol and symbol of every marked one,
+    // '\0' for characters which are not symbols
+    //
+    char marks_[256];
+    char unmarked_[256];
 };
 
 //
@@ -200,15 +843,153 @@ public:
 // and to load all transitions between states
 //
 class TuringMachine {
+public:
+    
+    //
+    // Interned id of the halt state and of the "no transition" state
+    //
+    const static int HALT = 0;
+    const static int STUCK = -1;
+    
+    //
+    // Tracing policy of executed transitions
+    //
+    // OFF does no I/O at all, BUFFERED collects transitions and writes
+    // them in large chunks, FULL writes and flushes every transition.
+    // Buffered transitions are written when the buffer fills, at the end
+    // of run(), by set_trace() and after every step() called by itself.
+    //
+    enum class Trace { OFF, BUFFERED, FULL };
+    
 private:
-    map<string, vector<unique_ptr<Transition>>> mapping_;
+    vector<string> states_;
+    unordered_map<string, int> state_ids_;
+    vector<vector<unique_ptr<Transition>>> mapping_;
     vector<unique_ptr<Tape>> tapes_;
-    string current_state_;
+    int start_state_;
+    int current_state_;
+    
+    //
+    // Halting kind of every state
+    //
+    vector<Program::Halting> halting_;
+    
+    //
+    // Get ids of all states of given halting kind
+    //
+    vector<int> get_halting_states(Program::Halting) const;
+    
+    //
+    // Set halting kind of named states, other states of the kind become NONE
+    //
+    void set_halting_states(const vector<string>&, Program::Halting);
+    
+    //
+    // Compiled program, built on demand and dropped on every change of transitions
+    //
+    shared_ptr<const Program> program_;
+    shared_ptr<const MultiTapeProgram> multi_tape_program_;
+    
+    //
+    // True while transitions exist only in the compiled program,
+    // as when the machine is loaded by load_compiled
+    //
+    bool compiled_only_ = false;
+    
+    //
+    // Rebuild transitions from compiled program
+    //
+    void materialize();
+    
+    bool detect_cycles_ = false;
+    
+    uint64_t steps_ = 0;
+    
+    Trace trace_ = Trace::OFF;
+    ostream* trace_out_ = &cout;
+    stringstream trace_buffer_;
+    
+    //
+    // Trace executed transition according to tracing policy
+    //
+    void trace(Transition&);
+    
+    //
+    // Write buffered transitions to the trace stream
+    //
+    void flush_trace();
+    
+    //
+    // Execute single step of the machine without flushing the trace
+    //
+    void advance();
+    
+    //
+    // Return dense id of the state with given name
+    //
+    // Unknown names are assigned the next free id.
+    // Names are kept only for printing and lookups by name.
+    //
+    int intern(const string&);
+    
+    //
+    // Redirect transition to the state with given id
+    //
+    void retarget(Transition&, int);
+    
+    //
+    // Redirect transitions to states with given ids to start state of given machine
+    //
+    // Returns ids of states of the given machine in this machine. All states,
+    // halt too, get fresh ids following the states of this machine and keep
+    // their halting kinds, so the machines never share state even if they use
+    // the same names. Each state is interned once no matter how many transitions
+    // it has. The given states stop being halting, start and current state
+    // among them become the start state of the given machine.
+    //
+    vector<int> join(const TuringMachine&, const vector<int>&);
+    
+    //
+    // Move transition of state with given id to ids returned by join
+    //
+    void adopt(Transition&, int, const vector<int>&);
+    
+    //
+    // Add states of given machine and continue by its start state
+    // where this machine went to states with given ids
+    //
+    void attach(const TuringMachine&, const vector<int>&);
+    void attach(TuringMachine&&, const vector<int>&);
    
     //
-    // Find transistions based on current state and input char from tape
+    // Find transistion based on current state and symbols under heads
+    //
+    // Symbols of all tapes, or of all tracks of the single tape,
+    // must match read symbols of the transition.
+    //
+    Transition* find_transitions();
+    
+    //
+    // Read symbol under head of tape, or track of the single tape, with given index
+    //
+    char read_symbol(int) const;
+    
     //
-    Transition* find_transitions(const char &input);
+    // Index of transitions of every state by packed read symbols
+    //
+    // Built on demand for the current count of tapes or tracks,
+    // machines with more of them are searched transition by transition.
+    //
+    const static int INDEXED_SYMBOLS = 8;
+    vector<unordered_map<uint64_t, Transition*>> index_;
+    int index_symbols_ = 0;
+    
+    void build_index(int);
+    
+    //
+    // Drop compiled programs and index after change of transitions
+    //
+    void invalidate();
 public:
     TuringMachine();
     TuringMachine(const TuringMachine&);
@@ -241,27 +1022,89 @@ public:
     //
     // Get all state transistions for given state
     //
-    vector<unique_ptr<Transition>>& get_transitions(const string&);
+    // Transitions are read only, the machine indexes and compiles them.
+    // They are changed by add_transition() and retarget().
+    //
+    const vector<unique_ptr<Transition>>& get_transitions(const string&);
+    
+    //
+    // Change next state of transition of given state
+    //
+    // Transition is given by its position in get_transitions().
+    // Throws out_of_range if the state has no such transition.
+    //
+    void retarget(const string&, size_t, const string&);
     
     
     //
     // Return true if machine finished successfuly, false otherwise
     //
-    // Machine can finish not successfuly if cannot get to halt state
+    // Machine can finish not successfuly if cannot get to accept state
     //
     bool is_finished_successfuly() const;
+    
+    //
+    // Set states where the machine stops and accepts
+    //
+    // Only halt state accepts by default.
+    //
+    void set_accept_states(const vector<string>&);
+    
+    //
+    // Set states where the machine stops and rejects
+    //
+    // No state rejects by default.
+    //
+    void set_reject_states(const vector<string>&);
    
     //
     // Return machine loaded by file
     //
+    // Throws ParseError when a line is not a valid transition.
+    //
     static TuringMachine load_machine(const string&);
     
+    //
+    // Return machine parsed from memory buffer
+    //
+    // The transition format is: read_symbols{old_state} -> write_symbols{new_state}commands
+    // or...                     6{increment} -> 7{decrement}L
+    //
+    // One transition per line, blank lines are skipped.
+    // State names are everything between the braces, blanks before
+    // the opening brace are not part of the symbols, and symbol '_'
+    // stands for EMPTY. Multiple tape transitions have a read symbol,
+    // write symbol and command L, R, S or N (same as S) for every tape.
+    // Throws ParseError with line and column of the first error.
+    //
+    static TuringMachine parse_machine(const char*, size_t);
+    static TuringMachine parse_machine(const string&);
+    
+    //
+    // Save compiled machine to file in binary format
+    //
+    // Returns false if the machine cannot be compiled
+    // or the file cannot be written.
+    //
+    bool save_compiled(const string&);
+    
+    //
+    // Return machine loaded from file written by save_compiled
+    //
+    // The file is mapped to memory and the transition table is copied
+    // at once, transitions are rebuilt only if the machine is changed or
+    // stepped through. Throws runtime_error if the file is not valid.
+    //
+    static TuringMachine load_compiled(const string&);
+    
     //
     // Loop over machine
     //
     // Loop over machine defining start state for the loop
     // and new transition when machine must stop
     //
+    // Transitions to accept states go to the loop state instead.
+    //
     void loop_over(const string&, Transition*);
     
     //
@@ -270,7 +1113,35 @@ public:
     // Compose current machine with given.
     // The result is current machine become composition of two machines
     //
-    void compose(TuringMachine);
+    // Where this machine accepts, the result continues by start state of
+    // given machine. Accept and reject states of the result are the ones
+    // of given machine, reject states of this machine still reject.
+    //
+    // States of given machine are renamed when this machine already has
+    // their names, by suffix "/2", "/3" and so on, so the machines never
+    // merge their states, not even halt state.
+    //
+    // Transitions of given machine are renumbered by table of its state ids,
+    // so nothing is searched by name per transition, but composing still
+    // takes time linear in count of transitions of given machine: passed by
+    // reference, every transition is copied; passed by rvalue, the lists of
+    // its states are moved whole and every transition only gets new ids and
+    // names of its states.
+    //
+    void compose(const TuringMachine&);
+    void compose(TuringMachine&&);
+    
+    //
+    // Return machine branching to one of two machines by result of the third
+    //
+    // The result runs the condition machine, then continues by the start
+    // state of the then machine where the condition accepts and by the start
+    // state of the else machine where the condition rejects. The machines are
+    // wired into single flat machine, states of the branches are renamed like
+    // by compose and keep their halting kinds. The result gets the tapes and
+    // the start state of the condition machine.
+    //
+    static TuringMachine branch(const TuringMachine&, const TuringMachine&, const TuringMachine&);
     
     
     //
@@ -278,21 +1149,126 @@ public:
     //
     void to_single_tape();
     
+    //
+    // Return classic single tape machine simulating this multiple tape machine
+    //
+    // The tape of the result holds tracks laid out by given encoding.
+    // Every step of this machine is simulated by sweep right collecting
+    // marked symbols of all tracks, followed by sweep left applying writes
+    // and moving marks track by track. Head leaving its track shifts the
+    // rest of the tape right by one cell, so simulation of t steps takes
+    // O(t^2) steps. If this machine has tapes, the result gets them encoded
+    // to single tape.
+    // Throws runtime_error if transitions do not read every tape
+    // or there are too many symbols to encode.
+    //
+    TuringMachine to_single_tape_machine(TrackEncoding* = nullptr);
+    
+    //
+    // Return deterministic machine equivalent to this nondeterministic one
+    //
+    // The result has four tapes: the input, the simulated tape, sequence of
+    // choices and marks of cells changed by the simulation. It tries all
+    // sequences of choices in order of length, each from the input again,
+    // until the simulated machine halts, then writes the simulated tape over
+    // the input. The result never stops if no sequence reaches halt state.
+    // If this machine has a tape, the result gets its copy and empty tapes.
+    // Throws runtime_error if this is multiple tape machine.
+    //
+    TuringMachine to_deterministic();
+    
+    
+    //
+    // Compile the machine to dense transition table
+    //
+    // Returns nullptr if the machine has transitions
+    // for multiple tapes, which cannot be compiled.
+    //
+    shared_ptr<const Program> compile();
+    
+    //
+    // Compile machine with multiple tapes to hash table of packed read symbols
+    //
+    // Returns nullptr if the machine has more than MAX_TAPES tapes
+    // or transitions which do not read symbol of every tape.
+    //
+    shared_ptr<const MultiTapeProgram> compile_multi_tape();
     
     //
     // Add state transistion to the machine
     //
     void add_transition(unique_ptr<Transition>);
     
+    //
+    // Set tracing policy and stream of executed transitions
+    //
+    // Tracing is off by default.
+    //
+    void set_trace(Trace, ostream& = cout);
+    
+    //
+    // Enable or disable detection of repeating configurations
+    //
+    // When enabled, run() returns LOOPING as soon as the machine
+    // reaches configuration (state, head position and tape) it has been
+    // in before. Uses Brent's algorithm with snapshot of the tape,
+    // so every step costs only a few more comparisons. Every write also
+    // looks up the cell in the snapshot, which takes constant time for
+    // paged tapes and walks runs from the last looked up cell for
+    // run-length tapes, so it is cheap while the head stays near.
+    // Only single tape machines run through compiled program are checked.
+    //
+    void set_cycle_detection(bool);
+    
     //
     // Execute single step of the machine
     //
+    // The traced transition is written to the trace stream before return,
+    // also when tracing is BUFFERED.
+    //
     void step();
     
     //
     // Run all the steps of the machine until halt or no exit
     //
-    void run();
+    RunResult run();
+    
+    //
+    // Run the machine for at most given count of steps
+    //
+    RunResult run(uint64_t);
+    
+    //
+    // Run the machine for at most given count of steps until the deadline
+    //
+    // The clock is read once per many thousands of steps, so limits
+    // cost next to nothing in the tight loop.
+    //
+    RunResult run(uint64_t, chrono::steady_clock::time_point);
+    
+    //
+    // Get count of steps executed by the last run
+    //
+    uint64_t get_steps() const;
+    
+    //
+    // Run the machine on many inputs in parallel
+    //
+    // Every input is written to its own tape and run from the start
+    // state of the machine by BatchRunner. Tapes of the machine are not
+    // used. Throws runtime_error if the machine can not be compiled.
+    //
+    vector<BatchResult> run_batch(const vector<string>&, unsigned = 0);
+    
+    //
+    // Run the machine as nondeterministic one
+    //
+    // Follows all transitions matching current state and symbol of the tape
+    // by NondeterministicRunner. The machine and its tape are not changed,
+    // machine without tape runs on empty one.
+    // Throws runtime_error if the machine can not be compiled.
+    //
+    SearchResult run_nondeterministic(const Program::Options& = Program::Options(), unsigned = 0);
     
     //
     // Print tapes of the machine